@@ -21,12 +21,13 @@ SOURCE_FILES = [
     'pollreactor.c', 'msgblock.c', 'trdispatch.c',
     'kin_cartesian.c', 'kin_corexy.c', 'kin_corexz.c', 'kin_delta.c',
     'kin_deltesian.c', 'kin_polar.c', 'kin_rotary_delta.c', 'kin_winch.c',
-    'kin_extruder.c', 'kin_shaper.c',
+    'kin_extruder.c', 'kin_shaper.c', 'lookahead.c', 'gcodeparse.c',
+    'trace.c',
 ]
 DEST_LIB = "c_helper.so"
 OTHER_FILES = [
     'list.h', 'serialqueue.h', 'stepcompress.h', 'itersolve.h', 'pyhelper.h',
-    'trapq.h', 'pollreactor.h', 'msgblock.h'
+    'trapq.h', 'pollreactor.h', 'msgblock.h', 'lookahead.h', 'trace.h'
 ]
 
 defs_stepcompress = """
@@ -59,6 +60,7 @@ defs_stepcompress = """
     void steppersync_set_time(struct steppersync *ss
         , double time_offset, double mcu_freq);
     int steppersync_flush(struct steppersync *ss, uint64_t move_clock);
+    void steppersync_get_stats(struct steppersync *ss, char *buf, int len);
 """
 
 defs_itersolve = """
@@ -75,6 +77,10 @@ defs_itersolve = """
     void itersolve_set_position(struct stepper_kinematics *sk
         , double x, double y, double z);
     double itersolve_get_commanded_pos(struct stepper_kinematics *sk);
+    struct itersolve_pool *itersolve_pool_alloc(int num_threads);
+    void itersolve_pool_free(struct itersolve_pool *ip);
+    int32_t itersolve_pool_generate_steps(struct itersolve_pool *ip
+        , struct stepper_kinematics **sk_list, int sk_num, double flush_time);
 """
 
 defs_trapq = """
@@ -85,11 +91,20 @@ defs_trapq = """
         double x_r, y_r, z_r;
     };
 
+    struct push_move {
+        struct trapq *tq;
+        double print_time, accel_t, cruise_t, decel_t;
+        double start_x, start_y, start_z;
+        double x_r, y_r, z_r;
+        double start_v, cruise_v, accel;
+    };
+
     void trapq_append(struct trapq *tq, double print_time
         , double accel_t, double cruise_t, double decel_t
         , double start_pos_x, double start_pos_y, double start_pos_z
         , double axes_r_x, double axes_r_y, double axes_r_z
         , double start_v, double cruise_v, double accel);
+    void trapq_append_moves(struct push_move *p, int count);
     struct trapq *trapq_alloc(void);
     void trapq_free(struct trapq *tq);
     void trapq_finalize_moves(struct trapq *tq, double print_time);
@@ -97,6 +112,26 @@ defs_trapq = """
         , double pos_x, double pos_y, double pos_z);
     int trapq_extract_old(struct trapq *tq, struct pull_move *p, int max
         , double start_time, double end_time);
+    void trapq_get_stats(struct trapq *tq, char *buf, int len);
+"""
+
+defs_lookahead = """
+    struct lookahead *lookahead_alloc(void);
+    void lookahead_free(struct lookahead *la);
+    void lookahead_reset(struct lookahead *la);
+    void lookahead_set_flush_time(struct lookahead *la, double flush_time);
+    void lookahead_set_junction_deviation(struct lookahead *la
+        , double junction_deviation);
+    int lookahead_add_move(struct lookahead *la, double move_d
+        , double min_move_t
+        , double start_x, double start_y, double start_z, double start_e
+        , double axes_r_x, double axes_r_y, double axes_r_z, double axes_r_e
+        , double accel, double max_cruise_v2, double delta_v2
+        , double smooth_delta_v2, double extruder_v2, int flags);
+    int lookahead_flush(struct lookahead *la, int lazy);
+    double lookahead_queue_moves(struct lookahead *la, int count
+        , double print_time, struct trapq *tq, struct trapq *extruder_tq
+        , double *end_times);
 """
 
 defs_kin_cartesian = """
@@ -162,6 +197,12 @@ defs_serialqueue = """
         uint64_t notify_id;
     };
 
+    struct serialqueue_engine *serialqueue_engine_alloc(int cpu
+        , int priority);
+    void serialqueue_engine_free(struct serialqueue_engine *e);
+    struct serialqueue *serialqueue_alloc_shared(int serial_fd
+        , char serial_fd_type, int client_id
+        , struct serialqueue_engine *engine);
     struct serialqueue *serialqueue_alloc(int serial_fd, char serial_fd_type
         , int client_id);
     void serialqueue_exit(struct serialqueue *sq);
@@ -197,6 +238,23 @@ defs_trdispatch = """
         , uint64_t expire_ticks, uint64_t min_extend_ticks);
 """
 
+defs_gcodeparse = """
+    int gcode_parse_moves(const char *data, int len, double *records
+        , int max_lines);
+"""
+
+defs_trace = """
+    struct trace_record {
+        double time, v1, v2;
+        uint32_t stage, id;
+    };
+
+    void trace_event(uint32_t stage, uint32_t id, double v1, double v2);
+    void trace_enable(int enable);
+    int trace_read(struct trace_record *recs, int max);
+    uint32_t trace_get_dropped(void);
+"""
+
 defs_pyhelper = """
     void set_python_logging_callback(void (*func)(const char *));
     double get_monotonic(void);
@@ -208,10 +266,10 @@ defs_std = """
 
 defs_all = [
     defs_pyhelper, defs_serialqueue, defs_std, defs_stepcompress,
-    defs_itersolve, defs_trapq, defs_trdispatch,
+    defs_itersolve, defs_trapq, defs_trdispatch, defs_lookahead,
     defs_kin_cartesian, defs_kin_corexy, defs_kin_corexz, defs_kin_delta,
     defs_kin_deltesian, defs_kin_polar, defs_kin_rotary_delta, defs_kin_winch,
-    defs_kin_extruder, defs_kin_shaper,
+    defs_kin_extruder, defs_kin_shaper, defs_gcodeparse, defs_trace,
 ]
 
 # Update filenames to an absolute path
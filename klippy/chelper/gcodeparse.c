@@ -0,0 +1,158 @@
+// Fast parsing of g-code move commands
+//
+// Copyright (C) 2026  The Klipper developers
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <math.h> // NAN
+#include <stdlib.h> // strtod
+#include <string.h> // memchr
+#include "compiler.h" // __visible
+
+// The python g-code parser handles every type of command.  This code
+// only recognizes simple G0/G1 commands (the bulk of any print) and
+// leaves all other lines for the python code.  Each line is stored in
+// GP_RECORD_SIZE doubles: the command (0 for G0, 1 for G1, or -1 if
+// the line must be parsed by the python code) followed by the X, Y, Z,
+// E, and F parameters (NAN if the parameter was not provided).
+enum { GP_CMD, GP_X, GP_Y, GP_Z, GP_E, GP_F, GP_RECORD_SIZE };
+
+#define MAX_NUMBER 64
+
+static inline int
+is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static inline int
+is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// Return the upper case letter at 'p' or 0 if 'p' is not a letter
+static inline int
+get_letter(const char *p)
+{
+    char c = *p;
+    if (c >= 'a' && c <= 'z')
+        return c - 'a' + 'A';
+    if (c >= 'A' && c <= 'Z')
+        return c;
+    return 0;
+}
+
+static const char *
+skip_space(const char *p, const char *end)
+{
+    while (p < end && is_space(*p))
+        p++;
+    return p;
+}
+
+// Parse a number (optional sign, digits, and optional decimal point)
+// that must be followed by a space, a letter, or the end of the line.
+// Returns the end of the number or NULL if it is not valid.
+static const char *
+parse_number(const char *p, const char *end, double *val)
+{
+    const char *start = p;
+    if (p < end && (*p == '-' || *p == '+'))
+        p++;
+    int digits = 0;
+    while (p < end && is_digit(*p))
+        p++, digits++;
+    if (p < end && *p == '.') {
+        p++;
+        while (p < end && is_digit(*p))
+            p++, digits++;
+    }
+    if (!digits || p - start >= MAX_NUMBER
+        || (p < end && !is_space(*p) && !get_letter(p)))
+        return NULL;
+    // Copy the number so that strtod() does not treat a following 'E'
+    // parameter as an exponent
+    char buf[MAX_NUMBER];
+    memcpy(buf, start, p - start);
+    buf[p - start] = '\0';
+    *val = strtod(buf, NULL);
+    return p;
+}
+
+// Parse a single line into a record
+static void
+parse_line(const char *p, const char *end, double *rec)
+{
+    int i;
+    rec[GP_CMD] = -1.;
+    for (i=GP_X; i<GP_RECORD_SIZE; i++)
+        rec[i] = NAN;
+    const char *comment = memchr(p, ';', end - p);
+    if (comment)
+        end = comment;
+    p = skip_space(p, end);
+    if (p < end && get_letter(p) == 'N') {
+        // Skip line number
+        p = skip_space(p + 1, end);
+        if (p >= end || !is_digit(*p))
+            return;
+        while (p < end && is_digit(*p))
+            p++;
+        p = skip_space(p, end);
+    }
+    // Check for G0 or G1 command
+    if (p >= end || get_letter(p) != 'G')
+        return;
+    p = skip_space(p + 1, end);
+    if (p >= end || (*p != '0' && *p != '1'))
+        return;
+    int cmd = *p++ - '0';
+    if (p < end && !is_space(*p) && !get_letter(p))
+        return;
+    // Parse parameters
+    for (;;) {
+        p = skip_space(p, end);
+        if (p >= end)
+            break;
+        int pos;
+        switch (get_letter(p)) {
+        case 'X': pos = GP_X; break;
+        case 'Y': pos = GP_Y; break;
+        case 'Z': pos = GP_Z; break;
+        case 'E': pos = GP_E; break;
+        case 'F': pos = GP_F; break;
+        default: return;
+        }
+        p++;
+        if (!isnan(rec[pos]) || (p < end && get_letter(p)))
+            // Repeated parameter or multi-letter parameter name
+            return;
+        p = parse_number(skip_space(p, end), end, &rec[pos]);
+        if (!p)
+            return;
+    }
+    rec[GP_CMD] = cmd;
+}
+
+// Parse a block of newline separated g-code lines.  Fills 'records'
+// (GP_RECORD_SIZE doubles per line) for up to 'max_lines' lines and
+// returns the number of lines in the block.
+int __visible
+gcode_parse_moves(const char *data, int len, double *records, int max_lines)
+{
+    const char *p = data, *end = data + len;
+    int count = 0;
+    for (;;) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol)
+            eol = end;
+        if (count < max_lines)
+            parse_line(p, eol, &records[count * GP_RECORD_SIZE]);
+        count++;
+        if (eol >= end)
+            break;
+        p = eol + 1;
+    }
+    return count;
+}
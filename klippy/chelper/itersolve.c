@@ -4,16 +4,115 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
-#include <math.h> // fabs
+#include <math.h> // fabs, sqrt
+#include <pthread.h> // pthread_mutex_lock
 #include <stddef.h> // offsetof
+#include <stdlib.h> // malloc
 #include <string.h> // memset
 #include "compiler.h" // __visible
 #include "itersolve.h" // itersolve_generate_steps
 #include "pyhelper.h" // errorf
 #include "stepcompress.h" // queue_append_start
+#include "trace.h" // trace_stamp
 #include "trapq.h" // struct move
 
 
+/****************************************************************
+ * Closed-form solver for linear kinematics
+ ****************************************************************/
+
+// Some kinematics (eg, cartesian and corexy) have a stepper position
+// that is a linear function of the distance traveled by the move:
+//   position(t) = base + ratio * move_get_distance(m, t)
+// As the move distance is a quadratic function of time, the time of
+// each step can be calculated directly (instead of being searched
+// for).  Step times are calculated in batches so that the inner
+// loop is free of dependencies on the step compression code.
+
+#define LINEAR_BATCH 16
+
+// Generate steps for a portion of a move that travels in one direction
+static int32_t
+linear_gen_steps_mono(struct stepper_kinematics *sk, struct move *m
+                      , double base, double ratio, double start, double end)
+{
+    double start_pos = base + ratio * move_get_distance(m, start);
+    double end_pos = base + ratio * move_get_distance(m, end);
+    double step_dist = sk->step_dist, half_step = .5 * step_dist;
+    double target, step_delta;
+    int sdir;
+    if (end_pos > start_pos) {
+        sdir = 1;
+        target = sk->commanded_pos + half_step;
+        step_delta = step_dist;
+    } else {
+        sdir = 0;
+        target = sk->commanded_pos - half_step;
+        step_delta = -step_dist;
+    }
+    // Find number of steps in range (a step is present if the
+    // position comes within a nanometer of the step target)
+    double rel_end = sdir ? end_pos - target : target - end_pos;
+    int count = 0;
+    if (rel_end >= -.000000001)
+        count = (int)((rel_end + .000000001) / step_dist) + 1;
+    // Solve "half_accel*t^2 + start_v*t - dist = 0" for each step.  The
+    // root is chosen based on the direction of travel of the move.
+    double start_v = m->start_v, half_accel = m->half_accel;
+    double mid_v = start_v + half_accel * (start + end);
+    double vsign = mid_v >= 0. ? 1. : -1., inv_ratio = 1. / ratio;
+    double start_v2 = start_v * start_v, accel4 = 4. * half_accel;
+    double times[LINEAR_BATCH];
+    while (count > 0) {
+        int batch = count > LINEAR_BATCH ? LINEAR_BATCH : count, i;
+        for (i=0; i<batch; i++) {
+            double dist = (target + i * step_delta - base) * inv_ratio;
+            double disc = start_v2 + accel4 * dist;
+            double denom = start_v + vsign * sqrt(disc > 0. ? disc : 0.);
+            double t = denom ? 2. * dist / denom : start;
+            times[i] = t < start ? start : (t > end ? end : t);
+        }
+        for (i=0; i<batch; i++) {
+            int ret = stepcompress_append(sk->sc, sdir, m->print_time
+                                          , times[i]);
+            if (ret)
+                return ret;
+        }
+        target += batch * step_delta;
+        count -= batch;
+    }
+    sk->commanded_pos = target - .5 * step_delta;
+    // Avoid rollback if stepper fully reaches step position
+    double rel_commanded = sk->commanded_pos - end_pos;
+    if (stepcompress_get_step_dir(sk->sc) ? rel_commanded <= 0.
+        : rel_commanded >= 0.)
+        return stepcompress_commit(sk->sc);
+    return 0;
+}
+
+// Generate step times for a portion of a move with linear kinematics
+static int32_t
+linear_gen_steps_range(struct stepper_kinematics *sk, struct move *m
+                       , double base, double ratio, double start, double end)
+{
+    if (!ratio || start >= end)
+        return 0;
+    double half_accel = m->half_accel;
+    if (half_accel) {
+        // Check for a change in direction within the range
+        double turn_time = -m->start_v / (2. * half_accel);
+        if (turn_time > start && turn_time < end) {
+            int32_t ret = linear_gen_steps_mono(sk, m, base, ratio
+                                                , start, turn_time);
+            if (ret)
+                return ret;
+            start = turn_time;
+        }
+    }
+    return linear_gen_steps_mono(sk, m, base, ratio, start, end);
+}
+
+
 /****************************************************************
  * Main iterative solver
  ****************************************************************/
@@ -36,6 +135,16 @@ itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
         start = 0.;
     if (end > m->move_t)
         end = m->move_t;
+    double base, ratio;
+    if (sk->calc_linear_cb && !sk->calc_linear_cb(sk, m, &base, &ratio)) {
+        // Stepper position is a quadratic function of time
+        int32_t ret = linear_gen_steps_range(sk, m, base, ratio, start, end);
+        if (ret)
+            return ret;
+        if (sk->post_cb)
+            sk->post_cb(sk);
+        return 0;
+    }
     struct timepos old_guess = {start, sk->commanded_pos}, guess = old_guess;
     int sdir = stepcompress_get_step_dir(sk->sc);
     int is_dir_change = 0, have_bracket = 0, check_oscillate = 0;
@@ -278,3 +387,168 @@ itersolve_get_commanded_pos(struct stepper_kinematics *sk)
 {
     return sk->commanded_pos;
 }
+
+
+/****************************************************************
+ * Parallel step generation
+ ****************************************************************/
+
+// Each stepper_kinematics has its own stepcompress queue, so steps
+// for different steppers may be generated concurrently.  The caller
+// thread also generates steps while waiting for the workers.
+
+struct itersolve_pool {
+    pthread_mutex_t lock; // protects variables below
+    pthread_cond_t cond, done_cond;
+    int num_threads, generation, do_exit, active_workers;
+    pthread_t *threads;
+    struct stepper_kinematics **sk_list;
+    int sk_num, next_sk, pending;
+    double flush_time;
+    int32_t ret;
+};
+
+// Generate steps for jobs on the pool until none remain (pool locked)
+static void
+pool_run_jobs(struct itersolve_pool *ip)
+{
+    while (ip->next_sk < ip->sk_num) {
+        struct stepper_kinematics *sk = ip->sk_list[ip->next_sk++];
+        double flush_time = ip->flush_time;
+        pthread_mutex_unlock(&ip->lock);
+        int32_t ret = itersolve_generate_steps(sk, flush_time);
+        pthread_mutex_lock(&ip->lock);
+        if (ret && !ip->ret)
+            ip->ret = ret;
+        ip->pending--;
+    }
+}
+
+// Main code for worker threads
+static void *
+pool_thread(void *data)
+{
+    struct itersolve_pool *ip = data;
+    pthread_mutex_lock(&ip->lock);
+    int generation = ip->generation;
+    for (;;) {
+        while (ip->generation == generation && !ip->do_exit)
+            pthread_cond_wait(&ip->cond, &ip->lock);
+        if (ip->do_exit)
+            break;
+        generation = ip->generation;
+        ip->active_workers++;
+        pool_run_jobs(ip);
+        ip->active_workers--;
+        if (!ip->pending && !ip->active_workers)
+            pthread_cond_signal(&ip->done_cond);
+    }
+    pthread_mutex_unlock(&ip->lock);
+    return NULL;
+}
+
+// Allocate a pool with the given number of worker threads
+struct itersolve_pool * __visible
+itersolve_pool_alloc(int num_threads)
+{
+    struct itersolve_pool *ip = malloc(sizeof(*ip));
+    memset(ip, 0, sizeof(*ip));
+    int ret = pthread_mutex_init(&ip->lock, NULL);
+    if (ret)
+        goto fail;
+    ret = pthread_cond_init(&ip->cond, NULL);
+    if (ret)
+        goto fail;
+    ret = pthread_cond_init(&ip->done_cond, NULL);
+    if (ret)
+        goto fail;
+    if (num_threads <= 0)
+        return ip;
+    ip->threads = malloc(sizeof(*ip->threads) * num_threads);
+    for (; ip->num_threads < num_threads; ip->num_threads++) {
+        ret = pthread_create(&ip->threads[ip->num_threads], NULL
+                             , pool_thread, ip);
+        if (ret) {
+            // Continue with the threads that were successfully started
+            report_errno("pthread_create", ret);
+            break;
+        }
+    }
+    return ip;
+
+fail:
+    report_errno("itersolve_pool_alloc", ret);
+    free(ip);
+    return NULL;
+}
+
+// Stop all worker threads and free the pool
+void __visible
+itersolve_pool_free(struct itersolve_pool *ip)
+{
+    if (!ip)
+        return;
+    pthread_mutex_lock(&ip->lock);
+    ip->do_exit = 1;
+    pthread_cond_broadcast(&ip->cond);
+    pthread_mutex_unlock(&ip->lock);
+    int i;
+    for (i = 0; i < ip->num_threads; i++) {
+        int ret = pthread_join(ip->threads[i], NULL);
+        if (ret)
+            report_errno("pthread_join", ret);
+    }
+    free(ip->threads);
+    free(ip);
+}
+
+// Generate step times for a list of steppers up to the given flush_time
+static int32_t
+pool_generate_steps(struct itersolve_pool *ip
+                    , struct stepper_kinematics **sk_list
+                    , int sk_num, double flush_time)
+{
+    // Sentinels are shared between steppers - update them up front
+    int i;
+    for (i = 0; i < sk_num; i++)
+        if (sk_list[i]->tq)
+            trapq_check_sentinels(sk_list[i]->tq);
+    if (!ip->num_threads || sk_num <= 1) {
+        for (i = 0; i < sk_num; i++) {
+            int32_t ret = itersolve_generate_steps(sk_list[i], flush_time);
+            if (ret)
+                return ret;
+        }
+        return 0;
+    }
+    pthread_mutex_lock(&ip->lock);
+    ip->sk_list = sk_list;
+    ip->sk_num = ip->pending = sk_num;
+    ip->next_sk = 0;
+    ip->flush_time = flush_time;
+    ip->ret = 0;
+    ip->generation++;
+    pthread_cond_broadcast(&ip->cond);
+    pool_run_jobs(ip);
+    while (ip->pending || ip->active_workers)
+        pthread_cond_wait(&ip->done_cond, &ip->lock);
+    int32_t ret = ip->ret;
+    ip->sk_list = NULL;
+    ip->sk_num = 0;
+    pthread_mutex_unlock(&ip->lock);
+    return ret;
+}
+
+// Generate steps (and note the time taken if tracing is enabled)
+int32_t __visible
+itersolve_pool_generate_steps(struct itersolve_pool *ip
+                              , struct stepper_kinematics **sk_list
+                              , int sk_num, double flush_time)
+{
+    if (!trace_is_active())
+        return pool_generate_steps(ip, sk_list, sk_num, flush_time);
+    double start = get_monotonic();
+    int32_t ret = pool_generate_steps(ip, sk_list, sk_num, flush_time);
+    trace_event(TRACE_GEN_STEPS, sk_num, flush_time, get_monotonic() - start);
+    return ret;
+}
@@ -11,6 +11,8 @@ struct stepper_kinematics;
 struct move;
 typedef double (*sk_calc_callback)(struct stepper_kinematics *sk, struct move *m
                                    , double move_time);
+typedef int (*sk_linear_callback)(struct stepper_kinematics *sk, struct move *m
+                                  , double *base, double *ratio);
 typedef void (*sk_post_callback)(struct stepper_kinematics *sk);
 struct stepper_kinematics {
     double step_dist, commanded_pos;
@@ -22,6 +24,7 @@ struct stepper_kinematics {
     double gen_steps_pre_active, gen_steps_post_active;
 
     sk_calc_callback calc_position_cb;
+    sk_linear_callback calc_linear_cb;
     sk_post_callback post_cb;
 };
 
@@ -37,5 +40,10 @@ double itersolve_calc_position_from_coord(struct stepper_kinematics *sk
 void itersolve_set_position(struct stepper_kinematics *sk
                             , double x, double y, double z);
 double itersolve_get_commanded_pos(struct stepper_kinematics *sk);
+struct itersolve_pool *itersolve_pool_alloc(int num_threads);
+void itersolve_pool_free(struct itersolve_pool *ip);
+int32_t itersolve_pool_generate_steps(struct itersolve_pool *ip
+                                      , struct stepper_kinematics **sk_list
+                                      , int sk_num, double flush_time);
 
 #endif // itersolve.h
@@ -0,0 +1,317 @@
+// Move lookahead and junction velocity planning
+//
+// Copyright (C) 2016-2021  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <math.h> // sqrt
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // __visible
+#include "lookahead.h" // struct lookahead
+#include "trapq.h" // trapq_append_moves
+
+// Common suffixes: _d is distance (in mm), _v is velocity (in
+//   mm/second), _v2 is velocity squared (mm^2/s^2), _t is time (in
+//   seconds), _r is ratio (scalar between 0.0 and 1.0)
+
+#define LOOKAHEAD_FLUSH_TIME 0.250
+#define LOOKAHEAD_INIT_SIZE 256
+#define LOOKAHEAD_BATCH_SIZE 64
+
+static inline double
+min_v2(double a, double b)
+{
+    return b < a ? b : a;
+}
+
+// Return the move at the given index from the start of the queue
+static inline struct lookahead_move *
+lookahead_get(struct lookahead *la, int index)
+{
+    return &la->moves[(la->first + index) & (la->size - 1)];
+}
+
+// Allocate a new 'lookahead' object
+struct lookahead * __visible
+lookahead_alloc(void)
+{
+    struct lookahead *la = malloc(sizeof(*la));
+    memset(la, 0, sizeof(*la));
+    la->size = LOOKAHEAD_INIT_SIZE;
+    la->moves = malloc(sizeof(*la->moves) * la->size);
+    la->junction_flush = LOOKAHEAD_FLUSH_TIME;
+    return la;
+}
+
+// Free memory associated with a 'lookahead' object
+void __visible
+lookahead_free(struct lookahead *la)
+{
+    if (!la)
+        return;
+    free(la->moves);
+    free(la);
+}
+
+// Discard all queued moves
+void __visible
+lookahead_reset(struct lookahead *la)
+{
+    la->first = la->count = 0;
+    la->junction_flush = LOOKAHEAD_FLUSH_TIME;
+}
+
+// Set the amount of queued move time that triggers a lazy flush
+void __visible
+lookahead_set_flush_time(struct lookahead *la, double flush_time)
+{
+    la->junction_flush = flush_time;
+}
+
+void __visible
+lookahead_set_junction_deviation(struct lookahead *la
+                                 , double junction_deviation)
+{
+    la->junction_deviation = junction_deviation;
+}
+
+// Double the size of the ring buffer
+static void
+lookahead_expand(struct lookahead *la)
+{
+    int new_size = la->size * 2;
+    struct lookahead_move *moves = malloc(sizeof(*moves) * new_size);
+    int i;
+    for (i = 0; i < la->count; i++)
+        moves[i] = *lookahead_get(la, i);
+    free(la->moves);
+    la->moves = moves;
+    la->size = new_size;
+    la->first = 0;
+}
+
+// Calculate the maximum junction velocity between two moves
+static void
+calc_junction(struct lookahead *la, struct lookahead_move *m
+              , struct lookahead_move *prev_move, double extruder_v2)
+{
+    if (!(m->flags & LM_KINEMATIC) || !(prev_move->flags & LM_KINEMATIC))
+        return;
+    // Find max velocity using "approximated centripetal velocity"
+    double junction_cos_theta = -(m->axes_r.x * prev_move->axes_r.x
+                                  + m->axes_r.y * prev_move->axes_r.y
+                                  + m->axes_r.z * prev_move->axes_r.z);
+    if (junction_cos_theta > 0.999999)
+        return;
+    if (junction_cos_theta < -0.999999)
+        junction_cos_theta = -0.999999;
+    double sin_theta_d2 = sqrt(0.5*(1.0-junction_cos_theta));
+    double R = (la->junction_deviation * sin_theta_d2
+                / (1. - sin_theta_d2));
+    // Approximated circle must contact moves no further away than mid-move
+    double tan_theta_d2 = sin_theta_d2 / sqrt(0.5*(1.0+junction_cos_theta));
+    double move_centripetal_v2 = .5 * m->move_d * tan_theta_d2 * m->accel;
+    double prev_move_centripetal_v2 = (.5 * prev_move->move_d * tan_theta_d2
+                                       * prev_move->accel);
+    // Apply limits
+    double max_start_v2 = R * m->accel;
+    max_start_v2 = min_v2(max_start_v2, R * prev_move->accel);
+    max_start_v2 = min_v2(max_start_v2, move_centripetal_v2);
+    max_start_v2 = min_v2(max_start_v2, prev_move_centripetal_v2);
+    max_start_v2 = min_v2(max_start_v2, extruder_v2);
+    max_start_v2 = min_v2(max_start_v2, m->max_cruise_v2);
+    max_start_v2 = min_v2(max_start_v2, prev_move->max_cruise_v2);
+    max_start_v2 = min_v2(max_start_v2, (prev_move->max_start_v2
+                                         + prev_move->delta_v2));
+    m->max_start_v2 = max_start_v2;
+    m->max_smoothed_v2 = min_v2(
+        max_start_v2, prev_move->max_smoothed_v2 + prev_move->smooth_delta_v2);
+}
+
+// Add a move to the end of the queue.  Returns 1 if enough moves are
+// queued that a lazy flush should be performed.
+int __visible
+lookahead_add_move(struct lookahead *la, double move_d, double min_move_t
+                   , double start_x, double start_y, double start_z
+                   , double start_e
+                   , double axes_r_x, double axes_r_y, double axes_r_z
+                   , double axes_r_e, double accel, double max_cruise_v2
+                   , double delta_v2, double smooth_delta_v2
+                   , double extruder_v2, int flags)
+{
+    if (la->count >= la->size)
+        lookahead_expand(la);
+    struct lookahead_move *m = lookahead_get(la, la->count);
+    memset(m, 0, sizeof(*m));
+    m->move_d = move_d;
+    m->min_move_t = min_move_t;
+    m->accel = accel;
+    m->start_pos = (struct coord){ .x=start_x, .y=start_y, .z=start_z };
+    m->axes_r = (struct coord){ .x=axes_r_x, .y=axes_r_y, .z=axes_r_z };
+    m->start_e = start_e;
+    m->axes_r_e = axes_r_e;
+    m->flags = flags;
+    m->max_cruise_v2 = max_cruise_v2;
+    m->delta_v2 = delta_v2;
+    m->smooth_delta_v2 = smooth_delta_v2;
+    la->count++;
+    if (la->count == 1)
+        return 0;
+    calc_junction(la, m, lookahead_get(la, la->count - 2), extruder_v2);
+    la->junction_flush -= m->min_move_t;
+    // Enough moves have been queued to reach the target flush time.
+    return la->junction_flush <= 0.;
+}
+
+// Determine accel, cruise, and decel portions of a move
+static void
+set_junction(struct lookahead_move *m, double start_v2, double cruise_v2
+             , double end_v2)
+{
+    // Determine accel, cruise, and decel portions of the move distance
+    double half_inv_accel = .5 / m->accel;
+    double accel_d = (cruise_v2 - start_v2) * half_inv_accel;
+    double decel_d = (cruise_v2 - end_v2) * half_inv_accel;
+    double cruise_d = m->move_d - accel_d - decel_d;
+    // Determine move velocities
+    double start_v = m->start_v = sqrt(start_v2);
+    double cruise_v = m->cruise_v = sqrt(cruise_v2);
+    double end_v = sqrt(end_v2);
+    // Determine time spent in each portion of move (time is the
+    // distance divided by average velocity)
+    m->accel_t = accel_d / ((start_v + cruise_v) * 0.5);
+    m->cruise_t = cruise_d / cruise_v;
+    m->decel_t = decel_d / ((end_v + cruise_v) * 0.5);
+}
+
+// Traverse the queue from last to first move and determine maximum
+// junction speed assuming the robot comes to a complete stop after
+// the last move.  Returns the number of moves ready to be queued
+// with lookahead_queue_moves().
+int __visible
+lookahead_flush(struct lookahead *la, int lazy)
+{
+    la->junction_flush = LOOKAHEAD_FLUSH_TIME;
+    int update_flush_count = lazy;
+    int flush_count = la->count;
+    // Delayed moves are always the moves immediately after 'i'
+    int delayed_count = 0;
+    double next_end_v2 = 0., next_smoothed_v2 = 0., peak_cruise_v2 = 0.;
+    int i;
+    for (i = la->count - 1; i >= 0; i--) {
+        struct lookahead_move *m = lookahead_get(la, i);
+        double reachable_start_v2 = next_end_v2 + m->delta_v2;
+        double start_v2 = min_v2(m->max_start_v2, reachable_start_v2);
+        double reachable_smoothed_v2 = next_smoothed_v2 + m->smooth_delta_v2;
+        double smoothed_v2 = min_v2(m->max_smoothed_v2, reachable_smoothed_v2);
+        if (smoothed_v2 < reachable_smoothed_v2) {
+            // It's possible for this move to accelerate
+            if (smoothed_v2 + m->smooth_delta_v2 > next_smoothed_v2
+                || delayed_count) {
+                // This move can decelerate or this is a full accel
+                // move after a full decel move
+                if (update_flush_count && peak_cruise_v2) {
+                    flush_count = i;
+                    update_flush_count = 0;
+                }
+                peak_cruise_v2 = min_v2(m->max_cruise_v2, (
+                    smoothed_v2 + reachable_smoothed_v2) * .5);
+                if (delayed_count) {
+                    // Propagate peak_cruise_v2 to any delayed moves
+                    if (!update_flush_count && i < flush_count) {
+                        double mc_v2 = peak_cruise_v2;
+                        int j;
+                        for (j = i + 1; j <= i + delayed_count; j++) {
+                            struct lookahead_move *dm = lookahead_get(la, j);
+                            double ms_v2 = dm->delayed_start_v2;
+                            double me_v2 = dm->delayed_end_v2;
+                            mc_v2 = min_v2(mc_v2, ms_v2);
+                            set_junction(dm, min_v2(ms_v2, mc_v2), mc_v2
+                                         , min_v2(me_v2, mc_v2));
+                        }
+                    }
+                    delayed_count = 0;
+                }
+            }
+            if (!update_flush_count && i < flush_count) {
+                double cruise_v2 = min_v2((start_v2 + reachable_start_v2) * .5
+                                          , m->max_cruise_v2);
+                cruise_v2 = min_v2(cruise_v2, peak_cruise_v2);
+                set_junction(m, min_v2(start_v2, cruise_v2), cruise_v2
+                             , min_v2(next_end_v2, cruise_v2));
+            }
+        } else {
+            // Delay calculating this move until peak_cruise_v2 is known
+            m->delayed_start_v2 = start_v2;
+            m->delayed_end_v2 = next_end_v2;
+            delayed_count++;
+        }
+        next_end_v2 = start_v2;
+        next_smoothed_v2 = smoothed_v2;
+    }
+    if (update_flush_count)
+        return 0;
+    return flush_count;
+}
+
+// Fill a push_move entry for trapq_append_moves()
+static void
+fill_push_move(struct push_move *p, struct trapq *tq, double print_time
+               , struct lookahead_move *m, struct coord start_pos
+               , struct coord axes_r, double ratio)
+{
+    p->tq = tq;
+    p->print_time = print_time;
+    p->accel_t = m->accel_t;
+    p->cruise_t = m->cruise_t;
+    p->decel_t = m->decel_t;
+    p->start_x = start_pos.x;
+    p->start_y = start_pos.y;
+    p->start_z = start_pos.z;
+    p->x_r = axes_r.x;
+    p->y_r = axes_r.y;
+    p->z_r = axes_r.z;
+    p->start_v = m->start_v * ratio;
+    p->cruise_v = m->cruise_v * ratio;
+    p->accel = m->accel * ratio;
+}
+
+// Add the first 'count' moves to the trapezoid motion queues and
+// remove them from the lookahead queue.  The end time of each move
+// is stored in 'end_times' and the final end time is returned.
+double __visible
+lookahead_queue_moves(struct lookahead *la, int count, double print_time
+                      , struct trapq *tq, struct trapq *extruder_tq
+                      , double *end_times)
+{
+    if (count > la->count)
+        count = la->count;
+    struct push_move batch[LOOKAHEAD_BATCH_SIZE];
+    int i, batch_count = 0;
+    for (i = 0; i < count; i++) {
+        struct lookahead_move *m = lookahead_get(la, i);
+        if (batch_count > LOOKAHEAD_BATCH_SIZE - 2) {
+            trapq_append_moves(batch, batch_count);
+            batch_count = 0;
+        }
+        if (m->flags & LM_KINEMATIC)
+            fill_push_move(&batch[batch_count++], tq, print_time, m
+                           , m->start_pos, m->axes_r, 1.);
+        if (m->flags & LM_EXTRUDE && extruder_tq) {
+            // Extruder trapq: x is extruder movement, y is pressure
+            // advance flag
+            struct coord start_e = { .x = m->start_e };
+            struct coord axes_r_e = {
+                .x = 1., .y = !!(m->flags & LM_PRESSURE_ADVANCE) };
+            fill_push_move(&batch[batch_count++], extruder_tq, print_time, m
+                           , start_e, axes_r_e, m->axes_r_e);
+        }
+        print_time = print_time + m->accel_t + m->cruise_t + m->decel_t;
+        end_times[i] = print_time;
+    }
+    trapq_append_moves(batch, batch_count);
+    la->first = (la->first + count) & (la->size - 1);
+    la->count -= count;
+    return print_time;
+}
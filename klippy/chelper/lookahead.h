@@ -0,0 +1,50 @@
+#ifndef LOOKAHEAD_H
+#define LOOKAHEAD_H
+
+#include "trapq.h" // struct coord
+
+enum {
+    LM_KINEMATIC = 1<<0, LM_EXTRUDE = 1<<1, LM_PRESSURE_ADVANCE = 1<<2,
+};
+
+struct lookahead_move {
+    // Move parameters
+    double move_d, min_move_t, accel;
+    struct coord start_pos, axes_r;
+    double start_e, axes_r_e;
+    int flags;
+    // Junction limits
+    double max_cruise_v2, delta_v2, smooth_delta_v2;
+    double max_start_v2, max_smoothed_v2;
+    // Temporary storage for "delayed" moves during lookahead
+    double delayed_start_v2, delayed_end_v2;
+    // Calculated trapezoid
+    double accel_t, cruise_t, decel_t;
+    double start_v, cruise_v;
+};
+
+struct lookahead {
+    struct lookahead_move *moves;
+    int size, first, count;
+    double junction_flush, junction_deviation;
+};
+
+struct lookahead *lookahead_alloc(void);
+void lookahead_free(struct lookahead *la);
+void lookahead_reset(struct lookahead *la);
+void lookahead_set_flush_time(struct lookahead *la, double flush_time);
+void lookahead_set_junction_deviation(struct lookahead *la
+                                      , double junction_deviation);
+int lookahead_add_move(struct lookahead *la, double move_d, double min_move_t
+                       , double start_x, double start_y, double start_z
+                       , double start_e
+                       , double axes_r_x, double axes_r_y, double axes_r_z
+                       , double axes_r_e, double accel, double max_cruise_v2
+                       , double delta_v2, double smooth_delta_v2
+                       , double extruder_v2, int flags);
+int lookahead_flush(struct lookahead *la, int lazy);
+double lookahead_queue_moves(struct lookahead *la, int count
+                             , double print_time, struct trapq *tq
+                             , struct trapq *extruder_tq, double *end_times);
+
+#endif // lookahead.h
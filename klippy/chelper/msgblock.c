@@ -4,6 +4,7 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include <pthread.h> // pthread_mutex_lock
 #include <stddef.h> // offsetof
 #include <stdlib.h> // malloc
 #include <string.h> // memset
@@ -123,11 +124,45 @@ msgblock_decode(uint32_t *data, int data_len, uint8_t *msg, int msg_len)
  * Command queues
  ****************************************************************/
 
+// Maximum number of released messages to keep for reuse
+#define MESSAGE_POOL_MAX 4096
+// Number of messages to allocate when the pool is empty
+#define MESSAGE_POOL_FILL 64
+
+// Released messages are kept for reuse to avoid malloc/free calls.
+// Messages are typically allocated in the main thread and freed in
+// the serialqueue background thread, so the pool has its own lock.
+static struct {
+    pthread_mutex_t lock;
+    struct list_head free_list;
+    uint32_t free_count, alloc_count, malloc_count;
+} message_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .free_list = { { &message_pool.free_list.root
+                     , &message_pool.free_list.root } },
+};
+
 // Allocate a 'struct queue_message' object
 struct queue_message *
 message_alloc(void)
 {
-    struct queue_message *qm = malloc(sizeof(*qm));
+    pthread_mutex_lock(&message_pool.lock);
+    if (list_empty(&message_pool.free_list)) {
+        // Refill the pool with a batch of new messages
+        int i;
+        for (i=0; i<MESSAGE_POOL_FILL; i++) {
+            struct queue_message *qm = malloc(sizeof(*qm));
+            list_add_head(&qm->node, &message_pool.free_list);
+        }
+        message_pool.free_count += MESSAGE_POOL_FILL;
+        message_pool.malloc_count += MESSAGE_POOL_FILL;
+    }
+    struct queue_message *qm = list_first_entry(
+        &message_pool.free_list, struct queue_message, node);
+    list_del(&qm->node);
+    message_pool.free_count--;
+    message_pool.alloc_count++;
+    pthread_mutex_unlock(&message_pool.lock);
     memset(qm, 0, sizeof(*qm));
     return qm;
 }
@@ -167,7 +202,29 @@ fail:
 void
 message_free(struct queue_message *qm)
 {
-    free(qm);
+    pthread_mutex_lock(&message_pool.lock);
+    message_pool.alloc_count--;
+    if (message_pool.free_count >= MESSAGE_POOL_MAX) {
+        pthread_mutex_unlock(&message_pool.lock);
+        free(qm);
+        return;
+    }
+    list_add_head(&qm->node, &message_pool.free_list);
+    message_pool.free_count++;
+    pthread_mutex_unlock(&message_pool.lock);
+}
+
+// Report the number of messages in use, in the pool, and the number
+// of calls to malloc() made to fill the pool
+void
+message_pool_stats(uint32_t *alloc_count, uint32_t *free_count
+                   , uint32_t *malloc_count)
+{
+    pthread_mutex_lock(&message_pool.lock);
+    *alloc_count = message_pool.alloc_count;
+    *free_count = message_pool.free_count;
+    *malloc_count = message_pool.malloc_count;
+    pthread_mutex_unlock(&message_pool.lock);
 }
 
 // Free all the messages on a queue
@@ -46,6 +46,8 @@ struct queue_message *message_alloc(void);
 struct queue_message *message_fill(uint8_t *data, int len);
 struct queue_message *message_alloc_and_encode(uint32_t *data, int len);
 void message_free(struct queue_message *qm);
+void message_pool_stats(uint32_t *alloc_count, uint32_t *free_count
+                        , uint32_t *malloc_count);
 void message_queue_free(struct list_head *root);
 uint64_t clock_from_clock32(struct clock_estimate *ce, uint32_t clock32);
 double clock_to_time(struct clock_estimate *ce, uint64_t clock);
@@ -7,8 +7,14 @@
 #include <fcntl.h> // fcntl
 #include <math.h> // ceil
 #include <poll.h> // poll
+#include <stdint.h> // uint32_t
+#include <stdio.h> // snprintf
 #include <stdlib.h> // malloc
 #include <string.h> // memset
+#include <sys/epoll.h> // epoll_wait
+#include <sys/timerfd.h> // timerfd_settime
+#include <unistd.h> // close
+#include "compiler.h" // ARRAY_SIZE
 #include "pollreactor.h" // pollreactor_alloc
 #include "pyhelper.h" // report_errno
 
@@ -17,6 +23,11 @@ struct pollreactor_timer {
     double (*callback)(void *data, double eventtime);
 };
 
+// Upper bounds (in seconds) of the timer lateness histogram buckets
+static const double late_bounds[PR_LATE_BUCKETS - 1] = {
+    .000025, .000100, .000500, .001000, .005000
+};
+
 struct pollreactor {
     int num_fds, num_timers, must_exit;
     void *callback_data;
@@ -24,11 +35,18 @@ struct pollreactor {
     struct pollfd *fds;
     void (**fd_callbacks)(void *data, double eventtime);
     struct pollreactor_timer *timers;
+    // epoll backend
+    int epoll_fd, timer_fd, busy;
+    double timer_fd_waketime;
+    // Stats (read from other threads using atomic loads)
+    uint32_t late_counts[PR_LATE_BUCKETS];
+    uint32_t late_max_us;
 };
 
 // Allocate a new 'struct pollreactor' object
 struct pollreactor *
-pollreactor_alloc(int num_fds, int num_timers, void *callback_data)
+pollreactor_alloc(int num_fds, int num_timers, void *callback_data
+                  , int flags)
 {
     struct pollreactor *pr = malloc(sizeof(*pr));
     memset(pr, 0, sizeof(*pr));
@@ -37,6 +55,34 @@ pollreactor_alloc(int num_fds, int num_timers, void *callback_data)
     pr->must_exit = 0;
     pr->callback_data = callback_data;
     pr->next_timer = PR_NEVER;
+    pr->epoll_fd = pr->timer_fd = -1;
+    if (flags & PR_F_EPOLL) {
+        // Use epoll for fd events and a timerfd for precise timer wakeups
+        pr->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (pr->epoll_fd < 0)
+            report_errno("epoll_create1", pr->epoll_fd);
+        else
+            pr->timer_fd = timerfd_create(CLOCK_MONOTONIC
+                                          , TFD_NONBLOCK | TFD_CLOEXEC);
+        if (pr->epoll_fd >= 0 && pr->timer_fd < 0) {
+            report_errno("timerfd_create", pr->timer_fd);
+            close(pr->epoll_fd);
+            pr->epoll_fd = -1;
+        }
+        if (pr->epoll_fd >= 0) {
+            struct epoll_event ev = { .events = EPOLLIN };
+            ev.data.u32 = num_fds;
+            int ret = epoll_ctl(pr->epoll_fd, EPOLL_CTL_ADD, pr->timer_fd
+                                , &ev);
+            if (ret < 0) {
+                report_errno("epoll_ctl", ret);
+                close(pr->timer_fd);
+                close(pr->epoll_fd);
+                pr->epoll_fd = pr->timer_fd = -1;
+            }
+            pr->timer_fd_waketime = PR_NEVER;
+        }
+    }
     pr->fds = malloc(num_fds * sizeof(*pr->fds));
     memset(pr->fds, 0, num_fds * sizeof(*pr->fds));
     pr->fd_callbacks = malloc(num_fds * sizeof(*pr->fd_callbacks));
@@ -53,6 +99,10 @@ pollreactor_alloc(int num_fds, int num_timers, void *callback_data)
 void
 pollreactor_free(struct pollreactor *pr)
 {
+    if (pr->epoll_fd >= 0) {
+        close(pr->epoll_fd);
+        close(pr->timer_fd);
+    }
     free(pr->fds);
     pr->fds = NULL;
     free(pr->fd_callbacks);
@@ -71,6 +121,13 @@ pollreactor_add_fd(struct pollreactor *pr, int pos, int fd, void *callback
     pr->fds[pos].events = POLLHUP | (write_only ? 0 : POLLIN);
     pr->fds[pos].revents = 0;
     pr->fd_callbacks[pos] = callback;
+    if (pr->epoll_fd >= 0) {
+        struct epoll_event ev = { .events = write_only ? 0 : EPOLLIN };
+        ev.data.u32 = pos;
+        int ret = epoll_ctl(pr->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        if (ret < 0)
+            report_errno("epoll_ctl", ret);
+    }
 }
 
 // Add a timer callback
@@ -97,6 +154,22 @@ pollreactor_update_timer(struct pollreactor *pr, int pos, double waketime)
         pr->next_timer = waketime;
 }
 
+// Note how late a timer callback was invoked
+static void
+pollreactor_note_late(struct pollreactor *pr, double late)
+{
+    int i;
+    for (i=0; i<PR_LATE_BUCKETS - 1; i++)
+        if (late < late_bounds[i])
+            break;
+    // Only this thread updates the counters
+    uint32_t *c = &pr->late_counts[i];
+    __atomic_store_n(c, *c + 1, __ATOMIC_RELAXED);
+    uint32_t late_us = late > 4000. ? 4000000000 : late * 1000000.;
+    if (late_us > pr->late_max_us)
+        __atomic_store_n(&pr->late_max_us, late_us, __ATOMIC_RELAXED);
+}
+
 // Internal code to invoke timer callbacks
 static int
 pollreactor_check_timers(struct pollreactor *pr, double eventtime, int busy)
@@ -110,6 +183,8 @@ pollreactor_check_timers(struct pollreactor *pr, double eventtime, int busy)
             double t = timer->waketime;
             if (eventtime >= t) {
                 busy = 1;
+                if (t != PR_NOW)
+                    pollreactor_note_late(pr, eventtime - t);
                 t = timer->callback(pr->callback_data, eventtime);
                 timer->waketime = t;
             }
@@ -124,10 +199,101 @@ pollreactor_check_timers(struct pollreactor *pr, double eventtime, int busy)
     return timeout < 1. ? 1 : (timeout > 1000. ? 1000 : (int)timeout);
 }
 
+// Arm the timerfd so that epoll_wait() wakes up at the next timer
+static void
+pollreactor_arm_timer_fd(struct pollreactor *pr)
+{
+    double waketime = pr->next_timer;
+    if (waketime == pr->timer_fd_waketime)
+        return;
+    pr->timer_fd_waketime = waketime;
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (waketime != PR_NEVER) {
+        // The timerfd uses CLOCK_MONOTONIC (not the CLOCK_MONOTONIC_RAW
+        // of get_monotonic()) so program a relative time
+        double delay = waketime - get_monotonic();
+        if (delay < .000000001)
+            delay = .000000001;
+        its.it_value = fill_time(delay);
+    }
+    int ret = timerfd_settime(pr->timer_fd, 0, &its, NULL);
+    if (ret < 0)
+        report_errno("timerfd_settime", ret);
+}
+
+// Invoke any pending timers and prepare the timerfd for the next
+// timer (epoll backend only).  Returns the maximum time (in ms) that
+// the caller may sleep before calling pollreactor_dispatch().
+int
+pollreactor_prepare(struct pollreactor *pr, double eventtime)
+{
+    int timeout = pollreactor_check_timers(pr, eventtime, pr->busy);
+    pr->busy = 0;
+    if (timeout)
+        pollreactor_arm_timer_fd(pr);
+    return timeout;
+}
+
+// Wait up to 'timeout' ms for fd events and invoke their callbacks
+// (epoll backend only).  Returns the time the wait completed.
+double
+pollreactor_dispatch(struct pollreactor *pr, int timeout)
+{
+    struct epoll_event events[8];
+    int ret = epoll_wait(pr->epoll_fd, events, ARRAY_SIZE(events), timeout);
+    double eventtime = get_monotonic();
+    if (ret < 0) {
+        report_errno("epoll_wait", ret);
+        pr->must_exit = 1;
+        return eventtime;
+    }
+    int i;
+    for (i=0; i<ret; i++) {
+        int pos = events[i].data.u32;
+        if (pos == pr->num_fds) {
+            // Timer fired - clear it and force it to be rearmed
+            uint64_t expirations;
+            int rret = read(pr->timer_fd, &expirations, sizeof(expirations));
+            if (rret < 0)
+                report_errno("timerfd read", rret);
+            pr->timer_fd_waketime = PR_NOW;
+            continue;
+        }
+        pr->busy = 1;
+        pr->fd_callbacks[pos](pr->callback_data, eventtime);
+    }
+    return eventtime;
+}
+
+// Return the epoll fd (which becomes readable whenever the reactor
+// has work to do) or -1 if the epoll backend is not in use
+int
+pollreactor_get_epoll_fd(struct pollreactor *pr)
+{
+    return pr->epoll_fd;
+}
+
+// Main loop of the epoll backend
+static void
+pollreactor_run_epoll(struct pollreactor *pr)
+{
+    double eventtime = get_monotonic();
+    pr->busy = 1;
+    while (! pr->must_exit) {
+        int timeout = pollreactor_prepare(pr, eventtime);
+        eventtime = pollreactor_dispatch(pr, timeout);
+    }
+}
+
 // Repeatedly check for timer and fd events and invoke their callbacks
 void
 pollreactor_run(struct pollreactor *pr)
 {
+    if (pr->epoll_fd >= 0) {
+        pollreactor_run_epoll(pr);
+        return;
+    }
     double eventtime = get_monotonic();
     int busy = 1;
     while (! pr->must_exit) {
@@ -162,6 +328,21 @@ pollreactor_is_exit(struct pollreactor *pr)
     return pr->must_exit;
 }
 
+// Report a histogram of how late timer callbacks were invoked
+void
+pollreactor_get_stats(struct pollreactor *pr, char *buf, int len)
+{
+    uint32_t c[PR_LATE_BUCKETS];
+    int i;
+    for (i=0; i<PR_LATE_BUCKETS; i++)
+        c[i] = __atomic_load_n(&pr->late_counts[i], __ATOMIC_RELAXED);
+    uint32_t late_max_us = __atomic_load_n(&pr->late_max_us, __ATOMIC_RELAXED);
+    snprintf(buf, len, "timer_late_25us=%u timer_late_100us=%u"
+             " timer_late_500us=%u timer_late_1ms=%u timer_late_5ms=%u"
+             " timer_late_over=%u timer_late_max=%.6f"
+             , c[0], c[1], c[2], c[3], c[4], c[5], late_max_us * .000001);
+}
+
 int
 fd_set_non_blocking(int fd)
 {
@@ -4,17 +4,26 @@
 #define PR_NOW   0.
 #define PR_NEVER 9999999999999999.
 
+// pollreactor_alloc() flags
+#define PR_F_EPOLL 0x01
+
+#define PR_LATE_BUCKETS 6
+
 struct pollreactor *pollreactor_alloc(int num_fds, int num_timers
-                                      , void *callback_data);
+                                      , void *callback_data, int flags);
 void pollreactor_free(struct pollreactor *pr);
 void pollreactor_add_fd(struct pollreactor *pr, int pos, int fd, void *callback
                         , int write_only);
 void pollreactor_add_timer(struct pollreactor *pr, int pos, void *callback);
 double pollreactor_get_timer(struct pollreactor *pr, int pos);
 void pollreactor_update_timer(struct pollreactor *pr, int pos, double waketime);
+int pollreactor_prepare(struct pollreactor *pr, double eventtime);
+double pollreactor_dispatch(struct pollreactor *pr, int timeout);
+int pollreactor_get_epoll_fd(struct pollreactor *pr);
 void pollreactor_run(struct pollreactor *pr);
 void pollreactor_do_exit(struct pollreactor *pr);
 int pollreactor_is_exit(struct pollreactor *pr);
+void pollreactor_get_stats(struct pollreactor *pr, char *buf, int len);
 int fd_set_non_blocking(int fd);
 
 #endif // pollreactor.h
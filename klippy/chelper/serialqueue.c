@@ -12,6 +12,8 @@
 // clock times, prioritizes commands, and handles retransmissions.  A
 // background thread is launched to do this work and minimize latency.
 
+#define _GNU_SOURCE // sendmmsg
+#include <errno.h> // errno
 #include <linux/can.h> // // struct can_frame
 #include <math.h> // fabs
 #include <pthread.h> // pthread_mutex_lock
@@ -20,6 +22,10 @@
 #include <stdio.h> // snprintf
 #include <stdlib.h> // malloc
 #include <string.h> // memset
+#include <sched.h> // sched_param
+#include <sys/epoll.h> // epoll_wait
+#include <sys/socket.h> // sendmmsg
+#include <sys/uio.h> // writev
 #include <termios.h> // tcflush
 #include <unistd.h> // pipe
 #include "compiler.h" // __visible
@@ -28,10 +34,44 @@
 #include "pollreactor.h" // pollreactor_alloc
 #include "pyhelper.h" // get_monotonic
 #include "serialqueue.h" // struct queue_message
+#include "trace.h" // trace_stamp
+
+// Heaps used to find the command_queue with the next message to send
+enum { CQH_READY, CQH_STALLED, CQH_NUM };
 
 struct command_queue {
     struct list_head stalled_queue, ready_queue;
     struct list_node node;
+    // Position (and sort key) of this queue in the serialqueue heaps
+    uint64_t heap_key[CQH_NUM], pending_seq;
+    int heap_pos[CQH_NUM];
+    // Number of batches for this queue still on the send ring
+    uint32_t ring_batches;
+};
+
+struct cq_heap {
+    struct command_queue **queues;
+    int count, size;
+};
+
+// Lock-free single producer / single consumer rings used to pass
+// messages between the main thread and the background thread
+#define SQ_RING_SIZE 256
+
+struct sq_ring {
+    uint32_t head, tail;
+    struct queue_message *msgs[SQ_RING_SIZE];
+};
+
+struct send_batch {
+    struct command_queue *cq;
+    struct list_node *first, *last;
+    int len;
+};
+
+struct send_ring {
+    uint32_t head, tail;
+    struct send_batch batches[SQ_RING_SIZE];
 };
 
 struct serialqueue {
@@ -44,6 +84,9 @@ struct serialqueue {
     int input_pos;
     // Threading
     pthread_t tid;
+    struct serialqueue_engine *engine;
+    struct list_node engine_node;
+    int engine_done;
     pthread_mutex_t lock; // protects variables below
     pthread_cond_t cond;
     int receive_waiting;
@@ -57,8 +100,16 @@ struct serialqueue {
     uint64_t ignore_nak_seq, last_ack_seq, retransmit_seq, rtt_sample_seq;
     struct list_head sent_queue;
     double srtt, rttvar, rto;
+    // Lock-free handoff of messages (see serialqueue_send_batch())
+    pthread_t producer_tid;
+    struct send_ring send_ring;
+    struct sq_ring receive_ring, pulled_ring;
+    uint32_t send_locked;
     // Pending transmission message queues
     struct list_head pending_queues;
+    struct cq_heap heaps[CQH_NUM];
+    uint64_t pending_seq;
+    int ready_background_count;
     int ready_bytes, stalled_bytes, need_ack_bytes, last_ack_bytes;
     uint64_t need_kick_clock;
     struct list_head notify_queue;
@@ -71,6 +122,7 @@ struct serialqueue {
     struct list_head old_sent, old_receive;
     // Stats
     uint32_t bytes_write, bytes_read, bytes_retransmit, bytes_invalid;
+    uint32_t syscalls_write, frames_write;
 };
 
 #define SQPF_SERIAL 0
@@ -117,6 +169,208 @@ debug_queue_add(struct list_head *root, struct queue_message *qm)
     message_free(old);
 }
 
+/****************************************************************
+ * Lock-free message rings
+ ****************************************************************/
+
+// Add a message to a ring (only called by the producer).  Returns
+// non-zero if the ring is full.
+static int
+sq_ring_push(struct sq_ring *r, struct queue_message *qm)
+{
+    uint32_t head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= SQ_RING_SIZE)
+        return -1;
+    r->msgs[head % SQ_RING_SIZE] = qm;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Remove a message from a ring (only called by the consumer).  Returns
+// NULL if the ring is empty.
+static struct queue_message *
+sq_ring_pop(struct sq_ring *r)
+{
+    uint32_t tail = r->tail;
+    if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+        return NULL;
+    struct queue_message *qm = r->msgs[tail % SQ_RING_SIZE];
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return qm;
+}
+
+// Add a batch of messages to the send ring (only called by the
+// producer thread).  Returns non-zero if the ring is full.
+static int
+send_ring_push(struct serialqueue *sq, struct command_queue *cq
+               , struct list_head *msgs, int len)
+{
+    struct send_ring *r = &sq->send_ring;
+    uint32_t head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= SQ_RING_SIZE)
+        return -1;
+    __atomic_add_fetch(&cq->ring_batches, 1, __ATOMIC_RELAXED);
+    struct send_batch *sb = &r->batches[head % SQ_RING_SIZE];
+    sb->cq = cq;
+    sb->first = msgs->root.next;
+    sb->last = msgs->root.prev;
+    sb->len = len;
+    // Full barrier - pairs with the need_kick_clock update in
+    // check_send_command()
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+// Check if there are batches on the send ring
+static int
+send_ring_pending(struct serialqueue *sq)
+{
+    struct send_ring *r = &sq->send_ring;
+    return __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) != r->tail;
+}
+
+static void queue_batch(struct serialqueue *sq, struct command_queue *cq
+                        , struct list_head *msgs, int len);
+
+// Move all batches on the send ring to their command queues (the
+// caller must hold sq->lock)
+static void
+send_ring_drain(struct serialqueue *sq)
+{
+    struct send_ring *r = &sq->send_ring;
+    uint32_t tail = r->tail;
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    while (tail != head) {
+        struct send_batch *sb = &r->batches[tail % SQ_RING_SIZE];
+        struct list_head msgs;
+        msgs.root.next = sb->first;
+        msgs.root.prev = sb->last;
+        sb->first->prev = sb->last->next = &msgs.root;
+        queue_batch(sq, sb->cq, &msgs, sb->len);
+        __atomic_sub_fetch(&sb->cq->ring_batches, 1, __ATOMIC_RELAXED);
+        tail++;
+    }
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+}
+
+// Add messages returned by serialqueue_pull() to the debug queue (the
+// caller must hold sq->lock)
+static void
+pulled_ring_drain(struct serialqueue *sq)
+{
+    struct queue_message *qm;
+    while ((qm = sq_ring_pop(&sq->pulled_ring))) {
+        if (qm->len)
+            debug_queue_add(&sq->old_receive, qm);
+        else
+            message_free(qm);
+    }
+}
+
+// Add a message to the receive queue (the caller must hold sq->lock)
+static void
+receive_queue_add(struct serialqueue *sq, struct queue_message *qm)
+{
+    // Messages go on the receive_queue list if the ring is full (and
+    // stay there until the consumer has caught up)
+    if (!list_empty(&sq->receive_queue) || sq_ring_push(&sq->receive_ring, qm))
+        list_add_tail(&qm->node, &sq->receive_queue);
+}
+
+
+/****************************************************************
+ * Command queue heaps
+ ****************************************************************/
+
+// Return true if command_queue 'a' sorts before 'b' in heap 'h'.  Ties
+// are broken by the order the queues were added to pending_queues.
+static inline int
+cq_heap_before(struct command_queue *a, struct command_queue *b, int h)
+{
+    if (a->heap_key[h] != b->heap_key[h])
+        return a->heap_key[h] < b->heap_key[h];
+    return a->pending_seq < b->pending_seq;
+}
+
+// Store a command_queue at the given position in a heap
+static inline void
+cq_heap_set(struct cq_heap *hp, int h, int pos, struct command_queue *cq)
+{
+    hp->queues[pos] = cq;
+    cq->heap_pos[h] = pos;
+}
+
+// Move a command_queue to its proper place in a heap
+static void
+cq_heap_sift(struct cq_heap *hp, int h, int pos, struct command_queue *cq)
+{
+    struct command_queue **q = hp->queues;
+    while (pos) {
+        int parent = (pos - 1) / 2;
+        if (!cq_heap_before(cq, q[parent], h))
+            break;
+        cq_heap_set(hp, h, pos, q[parent]);
+        pos = parent;
+    }
+    for (;;) {
+        int child = 2*pos + 1;
+        if (child >= hp->count)
+            break;
+        if (child + 1 < hp->count && cq_heap_before(q[child + 1], q[child], h))
+            child++;
+        if (!cq_heap_before(q[child], cq, h))
+            break;
+        cq_heap_set(hp, h, pos, q[child]);
+        pos = child;
+    }
+    cq_heap_set(hp, h, pos, cq);
+}
+
+// Update the position of a command_queue in the ready or stalled heap
+// after the first message on the corresponding queue changed
+static void
+cq_heap_update(struct serialqueue *sq, struct command_queue *cq, int h)
+{
+    struct cq_heap *hp = &sq->heaps[h];
+    struct list_head *lh = (h == CQH_READY ? &cq->ready_queue
+                            : &cq->stalled_queue);
+    int pos = cq->heap_pos[h];
+    if (h == CQH_READY && pos >= 0
+        && cq->heap_key[h] == BACKGROUND_PRIORITY_CLOCK)
+        sq->ready_background_count--;
+    if (list_empty(lh)) {
+        // Remove from heap
+        if (pos < 0)
+            return;
+        cq->heap_pos[h] = -1;
+        struct command_queue *last = hp->queues[--hp->count];
+        if (last != cq)
+            cq_heap_sift(hp, h, pos, last);
+        return;
+    }
+    struct queue_message *qm = list_first_entry(lh, struct queue_message, node);
+    cq->heap_key[h] = h == CQH_READY ? qm->req_clock : qm->min_clock;
+    if (h == CQH_READY && qm->req_clock == BACKGROUND_PRIORITY_CLOCK)
+        sq->ready_background_count++;
+    if (pos < 0) {
+        // Add to heap
+        if (hp->count >= hp->size) {
+            hp->size = hp->size ? hp->size * 2 : 16;
+            hp->queues = realloc(hp->queues, sizeof(*hp->queues) * hp->size);
+        }
+        pos = hp->count++;
+    }
+    cq_heap_sift(hp, h, pos, cq);
+}
+
+// Return the command_queue at the top of a heap (or NULL if empty)
+static inline struct command_queue *
+cq_heap_first(struct serialqueue *sq, int h)
+{
+    struct cq_heap *hp = &sq->heaps[h];
+    return hp->count ? hp->queues[0] : NULL;
+}
+
 // Wake up the receiver thread if it is waiting
 static void
 check_wake_receive(struct serialqueue *sq)
@@ -181,6 +435,7 @@ update_receive_seq(struct serialqueue *sq, double eventtime, uint64_t rseq)
     }
     sq->receive_seq = rseq;
     pollreactor_update_timer(sq->pr, SQPT_COMMAND, PR_NOW);
+    trace_stamp(TRACE_ACK, TRACE_PTR_ID(sq), rseq, 0.);
 
     // Update retransmit info
     if (sq->rtt_sample_seq && rseq > sq->rtt_sample_seq
@@ -236,6 +491,7 @@ handle_message(struct serialqueue *sq, double eventtime, int len)
         update_receive_seq(sq, eventtime, rseq);
     }
     sq->bytes_read += len;
+    pulled_ring_drain(sq);
 
     // Check for pending messages on notify_queue
     int must_wake = 0;
@@ -250,7 +506,7 @@ handle_message(struct serialqueue *sq, double eventtime, int len)
         qm->len = 0;
         qm->sent_time = sq->last_receive_sent_time;
         qm->receive_time = eventtime;
-        list_add_tail(&qm->node, &sq->receive_queue);
+        receive_queue_add(sq, qm);
         must_wake = 1;
     }
 
@@ -269,7 +525,7 @@ handle_message(struct serialqueue *sq, double eventtime, int len)
                          ? sq->last_receive_sent_time : 0.);
         qm->receive_time = get_monotonic(); // must be time post read()
         qm->receive_time -= calculate_bittime(sq, len);
-        list_add_tail(&qm->node, &sq->receive_queue);
+        receive_queue_add(sq, qm);
         must_wake = 1;
     }
 
@@ -356,30 +612,90 @@ kick_event(struct serialqueue *sq, double eventtime)
     pollreactor_update_timer(sq->pr, SQPT_COMMAND, PR_NOW);
 }
 
+#define CAN_WRITE_FRAMES 128
+
+// Write the given CAN frames (using as few system calls as possible)
 static void
-do_write(struct serialqueue *sq, void *buf, int buflen)
+do_write_can_frames(struct serialqueue *sq, struct can_frame *frames
+                    , int count)
+{
+    struct mmsghdr msgs[CAN_WRITE_FRAMES];
+    struct iovec iov[CAN_WRITE_FRAMES];
+    memset(msgs, 0, sizeof(msgs[0]) * count);
+    int i;
+    for (i=0; i<count; i++) {
+        iov[i].iov_base = &frames[i];
+        iov[i].iov_len = sizeof(frames[i]);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    sq->frames_write += count;
+    int pos = 0;
+    while (pos < count) {
+        sq->syscalls_write++;
+        int ret = sendmmsg(sq->serial_fd, &msgs[pos], count - pos, 0);
+        if (ret < 0 && (errno == ENOTSOCK || errno == ENOSYS)) {
+            // Not a socket - fall back to writing each frame
+            ret = write(sq->serial_fd, &frames[pos], sizeof(frames[pos]));
+            if (ret >= 0)
+                ret = 1;
+        }
+        if (ret < 0) {
+            report_errno("can write", ret);
+            return;
+        }
+        pos += ret;
+    }
+}
+
+// Write data to the serial port.  The data is passed as an iovec
+// array so that messages need not be copied into a single buffer.
+static void
+do_writev(struct serialqueue *sq, struct iovec *iov, int iovcnt)
 {
     if (sq->serial_fd_type != SQT_CAN) {
-        int ret = write(sq->serial_fd, buf, buflen);
+        sq->syscalls_write++;
+        int ret = writev(sq->serial_fd, iov, iovcnt);
         if (ret < 0)
             report_errno("write", ret);
         return;
     }
-    // Write to CAN fd
-    struct can_frame cf;
-    while (buflen) {
-        int size = buflen > 8 ? 8 : buflen;
-        cf.can_id = sq->client_id;
-        cf.can_dlc = size;
-        memcpy(cf.data, buf, size);
-        int ret = write(sq->serial_fd, &cf, sizeof(cf));
-        if (ret < 0) {
-            report_errno("can write", ret);
-            return;
+    // Split data into CAN frames
+    struct can_frame frames[CAN_WRITE_FRAMES];
+    int count = 0, i;
+    for (i=0; i<iovcnt; i++) {
+        uint8_t *buf = iov[i].iov_base;
+        int buflen = iov[i].iov_len;
+        while (buflen) {
+            if (!count || frames[count-1].can_dlc >= 8) {
+                // Start a new frame
+                if (count >= CAN_WRITE_FRAMES) {
+                    do_write_can_frames(sq, frames, count);
+                    count = 0;
+                }
+                frames[count].can_id = sq->client_id;
+                frames[count].can_dlc = 0;
+                count++;
+            }
+            struct can_frame *cf = &frames[count-1];
+            int size = 8 - cf->can_dlc;
+            if (size > buflen)
+                size = buflen;
+            memcpy(&cf->data[cf->can_dlc], buf, size);
+            cf->can_dlc += size;
+            buf += size;
+            buflen -= size;
         }
-        buf += size;
-        buflen -= size;
     }
+    if (count)
+        do_write_can_frames(sq, frames, count);
+}
+
+static void
+do_write(struct serialqueue *sq, void *buf, int buflen)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = buflen };
+    do_writev(sq, &iov, 1);
 }
 
 // Callback timer for when a retransmit should be done
@@ -395,17 +711,22 @@ retransmit_event(struct serialqueue *sq, double eventtime)
     pthread_mutex_lock(&sq->lock);
 
     // Retransmit all pending messages
-    uint8_t buf[MESSAGE_MAX * MAX_PENDING_BLOCKS + 1];
-    int buflen = 0, first_buflen = 0;
-    buf[buflen++] = MESSAGE_SYNC;
+    static uint8_t sync = MESSAGE_SYNC;
+    struct iovec iov[MAX_PENDING_BLOCKS + 1];
+    iov[0].iov_base = &sync;
+    iov[0].iov_len = 1;
+    int iovcnt = 1, buflen = 1, first_buflen = 0;
     struct queue_message *qm;
     list_for_each_entry(qm, &sq->sent_queue, node) {
-        memcpy(&buf[buflen], qm->msg, qm->len);
+        if (iovcnt >= ARRAY_SIZE(iov))
+            break;
+        iov[iovcnt].iov_base = qm->msg;
+        iov[iovcnt++].iov_len = qm->len;
         buflen += qm->len;
         if (!first_buflen)
             first_buflen = qm->len + 1;
     }
-    do_write(sq, buf, buflen);
+    do_writev(sq, iov, iovcnt);
     sq->bytes_retransmit += buflen;
 
     // Update rto
@@ -437,31 +758,25 @@ build_and_send_command(struct serialqueue *sq, uint8_t *buf, int pending
                        , double eventtime)
 {
     int len = MESSAGE_HEADER_SIZE;
+    uint64_t max_req_clock = 0;
     while (sq->ready_bytes) {
         // Find highest priority message (message with lowest req_clock)
-        uint64_t min_clock = MAX_CLOCK;
-        struct command_queue *q, *cq = NULL;
-        struct queue_message *qm = NULL;
-        list_for_each_entry(q, &sq->pending_queues, node) {
-            if (!list_empty(&q->ready_queue)) {
-                struct queue_message *m = list_first_entry(
-                    &q->ready_queue, struct queue_message, node);
-                if (m->req_clock < min_clock) {
-                    min_clock = m->req_clock;
-                    cq = q;
-                    qm = m;
-                }
-            }
-        }
+        struct command_queue *cq = cq_heap_first(sq, CQH_READY);
+        struct queue_message *qm = list_first_entry(
+            &cq->ready_queue, struct queue_message, node);
         // Append message to outgoing command
         if (len + qm->len > MESSAGE_MAX - MESSAGE_TRAILER_SIZE)
             break;
         list_del(&qm->node);
+        cq_heap_update(sq, cq, CQH_READY);
         if (list_empty(&cq->ready_queue) && list_empty(&cq->stalled_queue))
             list_del(&cq->node);
         memcpy(&buf[len], qm->msg, qm->len);
         len += qm->len;
         sq->ready_bytes -= qm->len;
+        if (qm->req_clock > max_req_clock
+            && qm->req_clock < BACKGROUND_PRIORITY_CLOCK)
+            max_req_clock = qm->req_clock;
         if (qm->notify_id) {
             // Message requires notification - add to notify list
             qm->req_clock = sq->send_seq;
@@ -492,6 +807,7 @@ build_and_send_command(struct serialqueue *sq, uint8_t *buf, int pending
         pollreactor_update_timer(sq->pr, SQPT_RETRANSMIT, idletime + sq->rto);
     if (!sq->rtt_sample_seq)
         sq->rtt_sample_seq = sq->send_seq;
+    trace_stamp(TRACE_SEND, TRACE_PTR_ID(sq), sq->send_seq, max_req_clock);
     sq->send_seq++;
     sq->need_ack_bytes += len;
     list_add_tail(&out->node, &sq->sent_queue);
@@ -502,6 +818,8 @@ build_and_send_command(struct serialqueue *sq, uint8_t *buf, int pending
 static double
 check_send_command(struct serialqueue *sq, int pending, double eventtime)
 {
+retry:
+    send_ring_drain(sq);
     if (sq->send_seq - sq->receive_seq >= MAX_PENDING_BLOCKS
         && sq->receive_seq != (uint64_t)-1)
         // Need an ack before more messages can be sent
@@ -521,33 +839,32 @@ check_send_command(struct serialqueue *sq, int pending, double eventtime)
     uint64_t ack_clock = clock_from_time(&sq->ce, idletime);
     uint64_t min_stalled_clock = MAX_CLOCK, min_ready_clock = MAX_CLOCK;
     struct command_queue *cq;
-    list_for_each_entry(cq, &sq->pending_queues, node) {
-        // Move messages from the stalled_queue to the ready_queue
-        while (!list_empty(&cq->stalled_queue)) {
-            struct queue_message *qm = list_first_entry(
-                &cq->stalled_queue, struct queue_message, node);
-            if (ack_clock < qm->min_clock) {
-                if (qm->min_clock < min_stalled_clock)
-                    min_stalled_clock = qm->min_clock;
-                break;
-            }
-            list_del(&qm->node);
-            list_add_tail(&qm->node, &cq->ready_queue);
-            sq->stalled_bytes -= qm->len;
-            sq->ready_bytes += qm->len;
-        }
-        // Update min_ready_clock
-        if (!list_empty(&cq->ready_queue)) {
-            struct queue_message *qm = list_first_entry(
-                &cq->ready_queue, struct queue_message, node);
-            uint64_t req_clock = qm->req_clock;
-            double bgtime = pending ? idletime : sq->idle_time;
-            double bgoffset = MIN_REQTIME_DELTA + MIN_BACKGROUND_DELTA;
-            if (req_clock == BACKGROUND_PRIORITY_CLOCK)
-                req_clock = clock_from_time(&sq->ce, bgtime + bgoffset);
-            if (req_clock < min_ready_clock)
-                min_ready_clock = req_clock;
+    // Move messages from the stalled_queues to the ready_queues
+    while ((cq = cq_heap_first(sq, CQH_STALLED))) {
+        struct queue_message *qm = list_first_entry(
+            &cq->stalled_queue, struct queue_message, node);
+        if (ack_clock < qm->min_clock) {
+            min_stalled_clock = qm->min_clock;
+            break;
         }
+        list_del(&qm->node);
+        list_add_tail(&qm->node, &cq->ready_queue);
+        sq->stalled_bytes -= qm->len;
+        sq->ready_bytes += qm->len;
+        cq_heap_update(sq, cq, CQH_STALLED);
+        if (list_is_first(&qm->node, &cq->ready_queue))
+            cq_heap_update(sq, cq, CQH_READY);
+    }
+    // Determine min_ready_clock
+    cq = cq_heap_first(sq, CQH_READY);
+    if (cq && cq->heap_key[CQH_READY] != BACKGROUND_PRIORITY_CLOCK)
+        min_ready_clock = cq->heap_key[CQH_READY];
+    if (sq->ready_background_count) {
+        double bgtime = pending ? idletime : sq->idle_time;
+        double bgoffset = MIN_REQTIME_DELTA + MIN_BACKGROUND_DELTA;
+        uint64_t req_clock = clock_from_time(&sq->ce, bgtime + bgoffset);
+        if (req_clock < min_ready_clock)
+            min_ready_clock = req_clock;
     }
 
     // Check for messages to send
@@ -556,7 +873,9 @@ check_send_command(struct serialqueue *sq, int pending, double eventtime)
     if (! sq->ce.est_freq) {
         if (sq->ready_bytes)
             return PR_NOW;
-        sq->need_kick_clock = MAX_CLOCK;
+        __atomic_store_n(&sq->need_kick_clock, MAX_CLOCK, __ATOMIC_SEQ_CST);
+        if (send_ring_pending(sq))
+            goto retry;
         return PR_NEVER;
     }
     uint64_t reqclock_delta = MIN_REQTIME_DELTA * sq->ce.est_freq;
@@ -565,7 +884,11 @@ check_send_command(struct serialqueue *sq, int pending, double eventtime)
     uint64_t wantclock = min_ready_clock - reqclock_delta;
     if (min_stalled_clock < wantclock)
         wantclock = min_stalled_clock;
-    sq->need_kick_clock = wantclock;
+    // Check for new messages added to the send ring by a producer
+    // that did not observe the updated need_kick_clock
+    __atomic_store_n(&sq->need_kick_clock, wantclock, __ATOMIC_SEQ_CST);
+    if (send_ring_pending(sq))
+        goto retry;
     return idletime + (wantclock - ack_clock) / sq->ce.est_freq;
 }
 
@@ -598,36 +921,274 @@ command_event(struct serialqueue *sq, double eventtime)
     return waketime;
 }
 
+// Wake any thread waiting in serialqueue_pull() after exit
+static void
+background_finish(struct serialqueue *sq)
+{
+    pthread_mutex_lock(&sq->lock);
+    check_wake_receive(sq);
+    pthread_mutex_unlock(&sq->lock);
+}
+
 // Main background thread for reading/writing to serial port
 static void *
 background_thread(void *data)
 {
     struct serialqueue *sq = data;
     pollreactor_run(sq->pr);
+    background_finish(sq);
+    return NULL;
+}
 
-    pthread_mutex_lock(&sq->lock);
-    check_wake_receive(sq);
-    pthread_mutex_unlock(&sq->lock);
 
+/****************************************************************
+ * Shared background thread
+ ****************************************************************/
+
+// A serialqueue_engine runs the background work of several
+// serialqueues from a single thread
+struct serialqueue_engine {
+    pthread_t tid;
+    int epoll_fd, pipe_fds[2], must_exit;
+    int cpu, priority;
+    pthread_mutex_t lock; // protects variables below
+    pthread_cond_t cond;
+    struct list_head new_queues;
+    int queue_count, exited;
+    // Queues currently serviced (only accessed by the engine thread)
+    struct list_head queues;
+};
+
+// Wake the engine thread
+static void
+engine_kick(struct serialqueue_engine *e)
+{
+    int ret = write(e->pipe_fds[1], ".", 1);
+    if (ret < 0)
+        report_errno("pipe write", ret);
+}
+
+// Apply the requested cpu affinity and realtime priority
+static void
+engine_set_sched(struct serialqueue_engine *e)
+{
+    if (e->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(e->cpu, &cpus);
+        int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (ret) {
+            // The error code is returned (errno is not set)
+            errno = ret;
+            report_errno("pthread_setaffinity_np", ret);
+        }
+    }
+    if (e->priority > 0) {
+        struct sched_param param = { .sched_priority = e->priority };
+        int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (ret) {
+            errno = ret;
+            report_errno("pthread_setschedparam", ret);
+        }
+    }
+}
+
+// Stop servicing a queue and wake any thread in serialqueue_exit()
+// (engine locked)
+static void
+engine_release_queue(struct serialqueue_engine *e, struct serialqueue *sq)
+{
+    list_del(&sq->engine_node);
+    background_finish(sq);
+    sq->engine_done = 1;
+    e->queue_count--;
+    pthread_cond_broadcast(&e->cond);
+}
+
+// Start servicing newly added queues and release queues that exited
+static void
+engine_update_queues(struct serialqueue_engine *e)
+{
+    pthread_mutex_lock(&e->lock);
+    while (!list_empty(&e->new_queues)) {
+        struct serialqueue *sq = list_first_entry(
+            &e->new_queues, struct serialqueue, engine_node);
+        list_del(&sq->engine_node);
+        list_add_tail(&sq->engine_node, &e->queues);
+        struct epoll_event ev = { .events = EPOLLIN };
+        ev.data.ptr = sq;
+        int ret = epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD
+                            , pollreactor_get_epoll_fd(sq->pr), &ev);
+        if (ret < 0) {
+            report_errno("epoll_ctl", ret);
+            pollreactor_do_exit(sq->pr);
+        }
+    }
+    struct serialqueue *sq, *n;
+    list_for_each_entry_safe(sq, n, &e->queues, engine_node) {
+        if (!pollreactor_is_exit(sq->pr))
+            continue;
+        epoll_ctl(e->epoll_fd, EPOLL_CTL_DEL
+                  , pollreactor_get_epoll_fd(sq->pr), NULL);
+        engine_release_queue(e, sq);
+    }
+    pthread_mutex_unlock(&e->lock);
+}
+
+// Exit all queues when the engine thread stops
+static void
+engine_release_all(struct serialqueue_engine *e)
+{
+    pthread_mutex_lock(&e->lock);
+    e->exited = 1;
+    list_join_tail(&e->new_queues, &e->queues);
+    list_init(&e->new_queues);
+    struct serialqueue *sq, *n;
+    list_for_each_entry_safe(sq, n, &e->queues, engine_node) {
+        pollreactor_do_exit(sq->pr);
+        engine_release_queue(e, sq);
+    }
+    pthread_mutex_unlock(&e->lock);
+}
+
+// Main loop of the shared background thread
+static void *
+engine_thread(void *data)
+{
+    struct serialqueue_engine *e = data;
+    engine_set_sched(e);
+    struct epoll_event events[16];
+    double eventtime = get_monotonic();
+    while (!e->must_exit) {
+        engine_update_queues(e);
+        // Run pending timers of each queue
+        int timeout = 1000;
+        struct serialqueue *sq;
+        list_for_each_entry(sq, &e->queues, engine_node) {
+            int t = pollreactor_prepare(sq->pr, eventtime);
+            if (t < timeout)
+                timeout = t;
+        }
+        // Wait for (and dispatch) fd activity
+        int ret = epoll_wait(e->epoll_fd, events, ARRAY_SIZE(events)
+                             , timeout);
+        if (ret < 0) {
+            report_errno("epoll_wait", ret);
+            break;
+        }
+        int i;
+        for (i=0; i<ret; i++) {
+            sq = events[i].data.ptr;
+            if (!sq) {
+                char dummy[4096];
+                int rret = read(e->pipe_fds[0], dummy, sizeof(dummy));
+                if (rret < 0)
+                    report_errno("pipe read", rret);
+                continue;
+            }
+            pollreactor_dispatch(sq->pr, 0);
+        }
+        eventtime = get_monotonic();
+    }
+    engine_release_all(e);
+    return NULL;
+}
+
+// Create a shared background thread.  If 'cpu' is not negative the
+// thread is pinned to that cpu.  If 'priority' is non-zero the thread
+// is run with the SCHED_FIFO realtime policy at that priority.
+struct serialqueue_engine * __visible
+serialqueue_engine_alloc(int cpu, int priority)
+{
+    struct serialqueue_engine *e = malloc(sizeof(*e));
+    memset(e, 0, sizeof(*e));
+    e->cpu = cpu;
+    e->priority = priority;
+    list_init(&e->new_queues);
+    list_init(&e->queues);
+    e->pipe_fds[0] = e->pipe_fds[1] = e->epoll_fd = -1;
+    int ret = pipe(e->pipe_fds);
+    if (ret)
+        goto fail;
+    fd_set_non_blocking(e->pipe_fds[0]);
+    fd_set_non_blocking(e->pipe_fds[1]);
+    e->epoll_fd = ret = epoll_create1(EPOLL_CLOEXEC);
+    if (ret < 0)
+        goto fail;
+    struct epoll_event ev = { .events = EPOLLIN };
+    ev.data.ptr = NULL;
+    ret = epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, e->pipe_fds[0], &ev);
+    if (ret < 0)
+        goto fail;
+    ret = pthread_mutex_init(&e->lock, NULL);
+    if (ret)
+        goto fail;
+    ret = pthread_cond_init(&e->cond, NULL);
+    if (ret)
+        goto fail;
+    ret = pthread_create(&e->tid, NULL, engine_thread, e);
+    if (ret)
+        goto fail;
+    return e;
+
+fail:
+    report_errno("engine init", ret);
+    if (e->epoll_fd >= 0)
+        close(e->epoll_fd);
+    if (e->pipe_fds[0] >= 0) {
+        close(e->pipe_fds[0]);
+        close(e->pipe_fds[1]);
+    }
+    free(e);
     return NULL;
 }
 
-// Create a new 'struct serialqueue' object
+// Stop a shared background thread (all its serialqueues must have
+// exited)
+void __visible
+serialqueue_engine_free(struct serialqueue_engine *e)
+{
+    if (!e)
+        return;
+    pthread_mutex_lock(&e->lock);
+    int queue_count = e->queue_count;
+    pthread_mutex_unlock(&e->lock);
+    if (queue_count) {
+        errorf("Memory leak! Can't free engine with active serialqueues");
+        return;
+    }
+    e->must_exit = 1;
+    engine_kick(e);
+    int ret = pthread_join(e->tid, NULL);
+    if (ret)
+        report_errno("pthread_join", ret);
+    close(e->epoll_fd);
+    close(e->pipe_fds[0]);
+    close(e->pipe_fds[1]);
+    free(e);
+}
+
+// Create a new 'struct serialqueue' object.  If 'engine' is not NULL
+// then the serialqueue is serviced by that shared background thread.
 struct serialqueue * __visible
-serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id)
+serialqueue_alloc_shared(int serial_fd, char serial_fd_type, int client_id
+                         , struct serialqueue_engine *engine)
 {
     struct serialqueue *sq = malloc(sizeof(*sq));
     memset(sq, 0, sizeof(*sq));
     sq->serial_fd = serial_fd;
     sq->serial_fd_type = serial_fd_type;
     sq->client_id = client_id;
+    sq->producer_tid = pthread_self();
 
     int ret = pipe(sq->pipe_fds);
     if (ret)
         goto fail;
 
     // Reactor setup
-    sq->pr = pollreactor_alloc(SQPF_NUM, SQPT_NUM, sq);
+    // (epoll can not be used with the regular file of a debug output)
+    int pr_flags = serial_fd_type == SQT_DEBUGFILE ? 0 : PR_F_EPOLL;
+    sq->pr = pollreactor_alloc(SQPF_NUM, SQPT_NUM, sq, pr_flags);
     pollreactor_add_fd(sq->pr, SQPF_SERIAL, serial_fd, input_event
                        , serial_fd_type==SQT_DEBUGFILE);
     pollreactor_add_fd(sq->pr, SQPF_PIPE, sq->pipe_fds[0], kick_event, 0);
@@ -672,6 +1233,19 @@ serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id)
     ret = pthread_mutex_init(&sq->fast_reader_dispatch_lock, NULL);
     if (ret)
         goto fail;
+    if (engine && pollreactor_get_epoll_fd(sq->pr) >= 0) {
+        pthread_mutex_lock(&engine->lock);
+        if (!engine->exited) {
+            sq->engine = engine;
+            list_add_tail(&sq->engine_node, &engine->new_queues);
+            engine->queue_count++;
+            pthread_mutex_unlock(&engine->lock);
+            engine_kick(engine);
+            return sq;
+        }
+        // The shared thread stopped - use a separate thread
+        pthread_mutex_unlock(&engine->lock);
+    }
     ret = pthread_create(&sq->tid, NULL, background_thread, sq);
     if (ret)
         goto fail;
@@ -683,12 +1257,30 @@ fail:
     return NULL;
 }
 
+// Create a new 'struct serialqueue' object with its own background
+// thread
+struct serialqueue * __visible
+serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id)
+{
+    return serialqueue_alloc_shared(serial_fd, serial_fd_type, client_id
+                                    , NULL);
+}
+
 // Request that the background thread exit
 void __visible
 serialqueue_exit(struct serialqueue *sq)
 {
     pollreactor_do_exit(sq->pr);
     kick_bg_thread(sq);
+    struct serialqueue_engine *e = sq->engine;
+    if (e) {
+        // Wait for the shared background thread to release this queue
+        pthread_mutex_lock(&e->lock);
+        while (!sq->engine_done)
+            pthread_cond_wait(&e->cond, &e->lock);
+        pthread_mutex_unlock(&e->lock);
+        return;
+    }
     int ret = pthread_join(sq->tid, NULL);
     if (ret)
         report_errno("pthread_join", ret);
@@ -703,6 +1295,11 @@ serialqueue_free(struct serialqueue *sq)
     if (!pollreactor_is_exit(sq->pr))
         serialqueue_exit(sq);
     pthread_mutex_lock(&sq->lock);
+    send_ring_drain(sq);
+    pulled_ring_drain(sq);
+    struct queue_message *qm;
+    while ((qm = sq_ring_pop(&sq->receive_ring)))
+        message_free(qm);
     message_queue_free(&sq->sent_queue);
     message_queue_free(&sq->receive_queue);
     message_queue_free(&sq->notify_queue);
@@ -714,9 +1311,12 @@ serialqueue_free(struct serialqueue *sq)
         list_del(&cq->node);
         message_queue_free(&cq->ready_queue);
         message_queue_free(&cq->stalled_queue);
+        cq->heap_pos[CQH_READY] = cq->heap_pos[CQH_STALLED] = -1;
     }
     pthread_mutex_unlock(&sq->lock);
     pollreactor_free(sq->pr);
+    free(sq->heaps[CQH_READY].queues);
+    free(sq->heaps[CQH_STALLED].queues);
     free(sq);
 }
 
@@ -728,6 +1328,7 @@ serialqueue_alloc_commandqueue(void)
     memset(cq, 0, sizeof(*cq));
     list_init(&cq->ready_queue);
     list_init(&cq->stalled_queue);
+    cq->heap_pos[CQH_READY] = cq->heap_pos[CQH_STALLED] = -1;
     return cq;
 }
 
@@ -737,7 +1338,8 @@ serialqueue_free_commandqueue(struct command_queue *cq)
 {
     if (!cq)
         return;
-    if (!list_empty(&cq->ready_queue) || !list_empty(&cq->stalled_queue)) {
+    if (!list_empty(&cq->ready_queue) || !list_empty(&cq->stalled_queue)
+        || __atomic_load_n(&cq->ring_batches, __ATOMIC_RELAXED)) {
         errorf("Memory leak! Can't free non-empty commandqueue");
         return;
     }
@@ -765,7 +1367,26 @@ serialqueue_rm_fastreader(struct serialqueue *sq, struct fastreader *fr)
     pthread_mutex_unlock(&sq->fast_reader_dispatch_lock);
 }
 
-// Add a batch of messages to the given command_queue
+// Add a batch of messages to cq->stalled_queue (the caller must hold
+// sq->lock)
+static void
+queue_batch(struct serialqueue *sq, struct command_queue *cq
+            , struct list_head *msgs, int len)
+{
+    if (list_empty(&cq->ready_queue) && list_empty(&cq->stalled_queue)) {
+        list_add_tail(&cq->node, &sq->pending_queues);
+        cq->pending_seq = sq->pending_seq++;
+    }
+    int was_stalled = !list_empty(&cq->stalled_queue);
+    list_join_tail(msgs, &cq->stalled_queue);
+    if (!was_stalled)
+        cq_heap_update(sq, cq, CQH_STALLED);
+    sq->stalled_bytes += len;
+}
+
+// Add a batch of messages to the given command_queue.  When called
+// from the thread that created the serialqueue the messages are
+// passed to the background thread without taking sq->lock.
 void
 serialqueue_send_batch(struct serialqueue *sq, struct command_queue *cq
                        , struct list_head *msgs)
@@ -782,19 +1403,30 @@ serialqueue_send_batch(struct serialqueue *sq, struct command_queue *cq
     if (! len)
         return;
     qm = list_first_entry(msgs, struct queue_message, node);
+    uint64_t min_clock = qm->min_clock;
 
-    // Add list to cq->stalled_queue
-    pthread_mutex_lock(&sq->lock);
-    if (list_empty(&cq->ready_queue) && list_empty(&cq->stalled_queue))
-        list_add_tail(&cq->node, &sq->pending_queues);
-    list_join_tail(msgs, &cq->stalled_queue);
-    sq->stalled_bytes += len;
     int mustwake = 0;
-    if (qm->min_clock < sq->need_kick_clock) {
-        sq->need_kick_clock = 0;
-        mustwake = 1;
+    if (pthread_equal(pthread_self(), sq->producer_tid)
+        && !send_ring_push(sq, cq, msgs, len)) {
+        // Messages added to send ring - only wake the background
+        // thread if it may be sleeping past the new min_clock
+        uint64_t nkc = __atomic_load_n(&sq->need_kick_clock, __ATOMIC_SEQ_CST);
+        if (min_clock < nkc)
+            mustwake = __atomic_compare_exchange_n(
+                &sq->need_kick_clock, &nkc, 0, 0
+                , __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    } else {
+        // Add list to cq->stalled_queue
+        pthread_mutex_lock(&sq->lock);
+        send_ring_drain(sq);
+        queue_batch(sq, cq, msgs, len);
+        sq->send_locked++;
+        if (min_clock < sq->need_kick_clock) {
+            __atomic_store_n(&sq->need_kick_clock, 0, __ATOMIC_SEQ_CST);
+            mustwake = 1;
+        }
+        pthread_mutex_unlock(&sq->lock);
     }
-    pthread_mutex_unlock(&sq->lock);
 
     // Wake the background thread if necessary
     if (mustwake)
@@ -831,34 +1463,48 @@ serialqueue_send(struct serialqueue *sq, struct command_queue *cq, uint8_t *msg
 void __visible
 serialqueue_pull(struct serialqueue *sq, struct pull_queue_message *pqm)
 {
-    pthread_mutex_lock(&sq->lock);
-    // Wait for message to be available
-    while (list_empty(&sq->receive_queue)) {
-        if (pollreactor_is_exit(sq->pr))
-            goto exit;
-        sq->receive_waiting = 1;
-        int ret = pthread_cond_wait(&sq->cond, &sq->lock);
-        if (ret)
-            report_errno("pthread_cond_wait", ret);
+    struct queue_message *qm = sq_ring_pop(&sq->receive_ring);
+    if (!qm) {
+        pthread_mutex_lock(&sq->lock);
+        // Wait for message to be available
+        for (;;) {
+            qm = sq_ring_pop(&sq->receive_ring);
+            if (qm)
+                break;
+            if (!list_empty(&sq->receive_queue)) {
+                // Ring was full - take message from overflow list
+                qm = list_first_entry(
+                    &sq->receive_queue, struct queue_message, node);
+                list_del(&qm->node);
+                break;
+            }
+            if (pollreactor_is_exit(sq->pr))
+                goto exit;
+            sq->receive_waiting = 1;
+            int ret = pthread_cond_wait(&sq->cond, &sq->lock);
+            if (ret)
+                report_errno("pthread_cond_wait", ret);
+        }
+        pthread_mutex_unlock(&sq->lock);
     }
 
-    // Remove message from queue
-    struct queue_message *qm = list_first_entry(
-        &sq->receive_queue, struct queue_message, node);
-    list_del(&qm->node);
-
     // Copy message
     memcpy(pqm->msg, qm->msg, qm->len);
     pqm->len = qm->len;
     pqm->sent_time = qm->sent_time;
     pqm->receive_time = qm->receive_time;
     pqm->notify_id = qm->notify_id;
-    if (qm->len)
-        debug_queue_add(&sq->old_receive, qm);
-    else
-        message_free(qm);
 
-    pthread_mutex_unlock(&sq->lock);
+    // Return message to background thread for the debug queue
+    if (sq_ring_push(&sq->pulled_ring, qm)) {
+        pthread_mutex_lock(&sq->lock);
+        pulled_ring_drain(sq);
+        if (qm->len)
+            debug_queue_add(&sq->old_receive, qm);
+        else
+            message_free(qm);
+        pthread_mutex_unlock(&sq->lock);
+    }
     return;
 
 exit:
@@ -915,22 +1561,54 @@ serialqueue_get_clock_est(struct serialqueue *sq, struct clock_estimate *ce)
 void __visible
 serialqueue_get_stats(struct serialqueue *sq, char *buf, int len)
 {
-    struct serialqueue stats;
+    // Only copy the stats fields (the serialqueue struct is large)
+    struct {
+        uint32_t bytes_write, bytes_read, bytes_retransmit, bytes_invalid;
+        uint64_t send_seq, receive_seq, retransmit_seq;
+        double srtt, rttvar, rto;
+        int ready_bytes, stalled_bytes;
+        uint32_t send_locked, syscalls_write, frames_write;
+    } stats;
     pthread_mutex_lock(&sq->lock);
-    memcpy(&stats, sq, sizeof(stats));
+    stats.bytes_write = sq->bytes_write;
+    stats.bytes_read = sq->bytes_read;
+    stats.bytes_retransmit = sq->bytes_retransmit;
+    stats.bytes_invalid = sq->bytes_invalid;
+    stats.send_seq = sq->send_seq;
+    stats.receive_seq = sq->receive_seq;
+    stats.retransmit_seq = sq->retransmit_seq;
+    stats.srtt = sq->srtt;
+    stats.rttvar = sq->rttvar;
+    stats.rto = sq->rto;
+    stats.ready_bytes = sq->ready_bytes;
+    stats.stalled_bytes = sq->stalled_bytes;
+    stats.send_locked = sq->send_locked;
+    stats.syscalls_write = sq->syscalls_write;
+    stats.frames_write = sq->frames_write;
     pthread_mutex_unlock(&sq->lock);
+    uint32_t msg_alloc, msg_free, msg_malloc;
+    message_pool_stats(&msg_alloc, &msg_free, &msg_malloc);
 
     snprintf(buf, len, "bytes_write=%u bytes_read=%u"
              " bytes_retransmit=%u bytes_invalid=%u"
              " send_seq=%u receive_seq=%u retransmit_seq=%u"
              " srtt=%.3f rttvar=%.3f rto=%.3f"
              " ready_bytes=%u stalled_bytes=%u"
+             " msg_alloc=%u msg_pool=%u msg_mallocs=%u send_locked=%u"
+             " syscalls_write=%u frames_write=%u"
              , stats.bytes_write, stats.bytes_read
              , stats.bytes_retransmit, stats.bytes_invalid
              , (int)stats.send_seq, (int)stats.receive_seq
              , (int)stats.retransmit_seq
              , stats.srtt, stats.rttvar, stats.rto
-             , stats.ready_bytes, stats.stalled_bytes);
+             , stats.ready_bytes, stats.stalled_bytes
+             , msg_alloc, msg_free, msg_malloc, stats.send_locked
+             , stats.syscalls_write, stats.frames_write);
+    int pos = strlen(buf);
+    if (pos + 1 < len) {
+        buf[pos++] = ' ';
+        pollreactor_get_stats(sq->pr, &buf[pos], len - pos);
+    }
 }
 
 // Extract old messages stored in the debug queues
@@ -947,6 +1625,7 @@ serialqueue_extract_old(struct serialqueue *sq, int sentq
 
     // Atomically replace existing debug list with new zero'd list
     pthread_mutex_lock(&sq->lock);
+    pulled_ring_drain(sq);
     list_join_tail(rootp, &current);
     list_init(rootp);
     list_join_tail(&replacement, rootp);
@@ -26,6 +26,12 @@ struct pull_queue_message {
 };
 
 struct serialqueue;
+struct serialqueue_engine;
+struct serialqueue_engine *serialqueue_engine_alloc(int cpu, int priority);
+void serialqueue_engine_free(struct serialqueue_engine *e);
+struct serialqueue *serialqueue_alloc_shared(
+    int serial_fd, char serial_fd_type, int client_id
+    , struct serialqueue_engine *engine);
 struct serialqueue *serialqueue_alloc(int serial_fd, char serial_fd_type
                                       , int client_id);
 void serialqueue_exit(struct serialqueue *sq);
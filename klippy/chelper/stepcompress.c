@@ -24,6 +24,7 @@
 #include "pyhelper.h" // errorf
 #include "serialqueue.h" // struct queue_message
 #include "stepcompress.h" // stepcompress_alloc
+#include "trace.h" // trace_stamp
 
 #define CHECK_LINES 1
 #define QUEUE_START_SIZE 1024
@@ -45,7 +46,8 @@ struct stepcompress {
     int next_step_dir;
     // History tracking
     int64_t last_position;
-    struct list_head history_list;
+    struct history_steps *history;
+    uint32_t history_size, history_start, history_count;
 };
 
 struct step_move {
@@ -57,7 +59,6 @@ struct step_move {
 #define HISTORY_EXPIRE (30.0)
 
 struct history_steps {
-    struct list_node node;
     uint64_t first_clock, last_clock;
     int64_t start_position;
     int step_count, interval, add;
@@ -107,10 +108,11 @@ minmax_point(struct stepcompress *sc, uint32_t *pos)
 static struct step_move
 compress_bisect_add(struct stepcompress *sc)
 {
-    uint32_t *qlast = sc->queue_next;
-    if (qlast > sc->queue_pos + 65535)
-        qlast = sc->queue_pos + 65535;
-    struct points point = minmax_point(sc, sc->queue_pos);
+    uint32_t *qpos = sc->queue_pos, qcount = sc->queue_next - qpos;
+    if (qcount > 65535)
+        qcount = 65535;
+    uint32_t lsc = sc->last_step_clock, max_error = sc->max_error;
+    struct points point = minmax_point(sc, qpos);
     int32_t outer_mininterval = point.minp, outer_maxinterval = point.maxp;
     int32_t add = 0, minadd = -0x8000, maxadd = 0x7fff;
     int32_t bestinterval = 0, bestcount = 1, bestadd = 1, bestreach = INT32_MIN;
@@ -121,15 +123,21 @@ compress_bisect_add(struct stepcompress *sc)
         struct points nextpoint;
         int32_t nextmininterval = outer_mininterval;
         int32_t nextmaxinterval = outer_maxinterval, interval = nextmaxinterval;
-        int32_t nextcount = 1;
+        int32_t nextcount = 1, nextaddfactor = 0;
+        uint32_t prevpoint = qpos[0] - lsc;
         for (;;) {
+            nextaddfactor += nextcount; // nextcount*(nextcount-1)/2
             nextcount++;
-            if (&sc->queue_pos[nextcount-1] >= qlast) {
+            if (nextcount - 1 >= qcount) {
                 int32_t count = nextcount - 1;
                 return (struct step_move){ interval, count, add };
             }
-            nextpoint = minmax_point(sc, sc->queue_pos + nextcount - 1);
-            int32_t nextaddfactor = nextcount*(nextcount-1)/2;
+            // Equivalent to minmax_point(sc, qpos + nextcount - 1)
+            uint32_t p = qpos[nextcount - 1] - lsc, err = (p - prevpoint) / 2;
+            if (err > max_error)
+                err = max_error;
+            nextpoint = (struct points){ p - err, p };
+            prevpoint = p;
             int32_t c = add*nextaddfactor;
             if (nextmininterval*nextcount < nextpoint.minp - c)
                 nextmininterval = idiv_up(nextpoint.minp - c, nextcount);
@@ -159,7 +167,6 @@ compress_bisect_add(struct stepcompress *sc)
         }
 
         // Check if a greater or lesser add could extend the sequence
-        int32_t nextaddfactor = nextcount*(nextcount-1)/2;
         int32_t nextreach = add*nextaddfactor + interval*nextcount;
         if (nextreach < nextpoint.minp) {
             minadd = add + 1;
@@ -250,7 +257,6 @@ stepcompress_alloc(uint32_t oid)
     struct stepcompress *sc = malloc(sizeof(*sc));
     memset(sc, 0, sizeof(*sc));
     list_init(&sc->msg_queue);
-    list_init(&sc->history_list);
     sc->oid = oid;
     sc->sdir = -1;
     return sc;
@@ -278,17 +284,62 @@ stepcompress_set_invert_sdir(struct stepcompress *sc, uint32_t invert_sdir)
     }
 }
 
-// Helper to free items from the history_list
+#define HISTORY_START_SIZE 256
+
+// Return the history entry at the given index (0 is the oldest entry)
+static inline struct history_steps *
+history_get(struct stepcompress *sc, uint32_t index)
+{
+    return &sc->history[(sc->history_start + index) & (sc->history_size - 1)];
+}
+
+// Add a new entry to the end of the history ring buffer
+static struct history_steps *
+history_append(struct stepcompress *sc)
+{
+    if (sc->history_count >= sc->history_size) {
+        // Grow the ring buffer (and make the contents contiguous)
+        uint32_t new_size = sc->history_size ? 2 * sc->history_size
+                                             : HISTORY_START_SIZE;
+        struct history_steps *h = malloc(sizeof(*h) * new_size);
+        uint32_t i;
+        for (i = 0; i < sc->history_count; i++)
+            h[i] = *history_get(sc, i);
+        free(sc->history);
+        sc->history = h;
+        sc->history_size = new_size;
+        sc->history_start = 0;
+    }
+    struct history_steps *hs = history_get(sc, sc->history_count++);
+    memset(hs, 0, sizeof(*hs));
+    return hs;
+}
+
+// Find the number of history entries with a first_clock <= clock
+static uint32_t
+history_search(struct stepcompress *sc, uint64_t clock)
+{
+    uint32_t lo = 0, hi = sc->history_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (history_get(sc, mid)->first_clock <= clock)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Helper to free items from the history
 static void
 free_history(struct stepcompress *sc, uint64_t end_clock)
 {
-    while (!list_empty(&sc->history_list)) {
-        struct history_steps *hs = list_last_entry(
-            &sc->history_list, struct history_steps, node);
+    while (sc->history_count) {
+        struct history_steps *hs = history_get(sc, 0);
         if (hs->last_clock > end_clock)
             break;
-        list_del(&hs->node);
-        free(hs);
+        sc->history_start = (sc->history_start + 1) & (sc->history_size - 1);
+        sc->history_count--;
     }
 }
 
@@ -300,7 +351,7 @@ stepcompress_free(struct stepcompress *sc)
         return;
     free(sc->queue);
     message_queue_free(&sc->msg_queue);
-    free_history(sc, UINT64_MAX);
+    free(sc->history);
     free(sc);
 }
 
@@ -360,7 +411,7 @@ add_move(struct stepcompress *sc, uint64_t first_clock, struct step_move *move)
     sc->last_step_clock = last_clock;
 
     // Create and store move in history tracking
-    struct history_steps *hs = malloc(sizeof(*hs));
+    struct history_steps *hs = history_append(sc);
     hs->first_clock = first_clock;
     hs->last_clock = last_clock;
     hs->start_position = sc->last_position;
@@ -368,7 +419,6 @@ add_move(struct stepcompress *sc, uint64_t first_clock, struct step_move *move)
     hs->add = move->add;
     hs->step_count = sc->sdir ? move->count : -move->count;
     sc->last_position += hs->step_count;
-    list_add_head(&hs->node, &sc->history_list);
 }
 
 // Convert previously scheduled steps into commands for the mcu
@@ -571,12 +621,14 @@ stepcompress_set_last_position(struct stepcompress *sc, uint64_t clock
         return ret;
     sc->last_position = last_position;
 
-    // Add a marker to the history list
-    struct history_steps *hs = malloc(sizeof(*hs));
-    memset(hs, 0, sizeof(*hs));
+    // Discard any history that the marker supersedes (the history
+    // must remain sorted by first_clock)
+    sc->history_count = clock ? history_search(sc, clock - 1) : 0;
+
+    // Add a marker to the history
+    struct history_steps *hs = history_append(sc);
     hs->first_clock = hs->last_clock = clock;
     hs->start_position = last_position;
-    list_add_head(&hs->node, &sc->history_list);
     return 0;
 }
 
@@ -584,29 +636,27 @@ stepcompress_set_last_position(struct stepcompress *sc, uint64_t clock
 int64_t __visible
 stepcompress_find_past_position(struct stepcompress *sc, uint64_t clock)
 {
-    int64_t last_position = sc->last_position;
-    struct history_steps *hs;
-    list_for_each_entry(hs, &sc->history_list, node) {
-        if (clock < hs->first_clock) {
-            last_position = hs->start_position;
-            continue;
-        }
-        if (clock >= hs->last_clock)
-            return hs->start_position + hs->step_count;
-        int32_t interval = hs->interval, add = hs->add;
-        int32_t ticks = (int32_t)(clock - hs->first_clock) + interval, offset;
-        if (!add) {
-            offset = ticks / interval;
-        } else {
-            // Solve for "count" using quadratic formula
-            double a = .5 * add, b = interval - .5 * add, c = -ticks;
-            offset = (sqrt(b*b - 4*a*c) - b) / (2. * a);
-        }
-        if (hs->step_count < 0)
-            return hs->start_position - offset;
-        return hs->start_position + offset;
+    uint32_t pos = history_search(sc, clock);
+    if (!pos) {
+        if (!sc->history_count)
+            return sc->last_position;
+        return history_get(sc, 0)->start_position;
+    }
+    struct history_steps *hs = history_get(sc, pos - 1);
+    if (clock >= hs->last_clock)
+        return hs->start_position + hs->step_count;
+    int32_t interval = hs->interval, add = hs->add;
+    int32_t ticks = (int32_t)(clock - hs->first_clock) + interval, offset;
+    if (!add) {
+        offset = ticks / interval;
+    } else {
+        // Solve for "count" using quadratic formula
+        double a = .5 * add, b = interval - .5 * add, c = -ticks;
+        offset = (sqrt(b*b - 4*a*c) - b) / (2. * a);
     }
-    return last_position;
+    if (hs->step_count < 0)
+        return hs->start_position - offset;
+    return hs->start_position + offset;
 }
 
 // Queue an mcu command to go out in order with stepper commands
@@ -623,18 +673,19 @@ stepcompress_queue_msg(struct stepcompress *sc, uint32_t *data, int len)
     return 0;
 }
 
-// Return history of queue_step commands
+// Return history of queue_step commands (newest first)
 int __visible
 stepcompress_extract_old(struct stepcompress *sc, struct pull_history_steps *p
                          , int max, uint64_t start_clock, uint64_t end_clock)
 {
     int res = 0;
-    struct history_steps *hs;
-    list_for_each_entry(hs, &sc->history_list, node) {
-        if (start_clock >= hs->last_clock || res >= max)
+    if (!end_clock)
+        return 0;
+    uint32_t pos = history_search(sc, end_clock - 1);
+    while (pos && res < max) {
+        struct history_steps *hs = history_get(sc, --pos);
+        if (start_clock >= hs->last_clock)
             break;
-        if (end_clock <= hs->first_clock)
-            continue;
         p->first_clock = hs->first_clock;
         p->last_clock = hs->last_clock;
         p->start_position = hs->start_position;
@@ -666,9 +717,13 @@ struct steppersync {
     // Storage for associated stepcompress objects
     struct stepcompress **sc_list;
     int sc_num;
+    // Heap of sc_list indexes used to merge the pending messages
+    int *merge_heap;
     // Storage for list of pending move clocks
     uint64_t *move_clocks;
     int num_move_clocks;
+    // Statistics
+    uint32_t flush_count, flush_msgs, flush_max_msgs;
 };
 
 // Allocate a new 'steppersync' object
@@ -684,6 +739,7 @@ steppersync_alloc(struct serialqueue *sq, struct stepcompress **sc_list
     ss->sc_list = malloc(sizeof(*sc_list)*sc_num);
     memcpy(ss->sc_list, sc_list, sizeof(*sc_list)*sc_num);
     ss->sc_num = sc_num;
+    ss->merge_heap = malloc(sizeof(*ss->merge_heap)*sc_num);
 
     ss->move_clocks = malloc(sizeof(*ss->move_clocks)*move_num);
     memset(ss->move_clocks, 0, sizeof(*ss->move_clocks)*move_num);
@@ -699,6 +755,7 @@ steppersync_free(struct steppersync *ss)
     if (!ss)
         return;
     free(ss->sc_list);
+    free(ss->merge_heap);
     free(ss->move_clocks);
     serialqueue_free_commandqueue(ss->cq);
     free(ss);
@@ -716,6 +773,23 @@ steppersync_set_time(struct steppersync *ss, double time_offset
     }
 }
 
+// Return a string buffer containing history statistics for all steppers
+void __visible
+steppersync_get_stats(struct steppersync *ss, char *buf, int len)
+{
+    uint32_t count = 0, size = 0;
+    int i;
+    for (i=0; i<ss->sc_num; i++) {
+        struct stepcompress *sc = ss->sc_list[i];
+        count += sc->history_count;
+        size += sc->history_size;
+    }
+    snprintf(buf, len, "step_history=%u step_history_size=%u"
+             " sync_flushes=%u sync_msgs=%u sync_max_msgs=%u"
+             , count, size, ss->flush_count, ss->flush_msgs
+             , ss->flush_max_msgs);
+}
+
 // Implement a binary heap algorithm to track when the next available
 // 'struct move' in the mcu will be available
 static void
@@ -741,9 +815,42 @@ heap_replace(struct steppersync *ss, uint64_t req_clock)
     }
 }
 
+// Return true if the next message of sc_list[a] should be sent
+// before the next message of sc_list[b]
+static inline int
+merge_before(struct steppersync *ss, int a, int b)
+{
+    struct queue_message *qa = list_first_entry(
+        &ss->sc_list[a]->msg_queue, struct queue_message, node);
+    struct queue_message *qb = list_first_entry(
+        &ss->sc_list[b]->msg_queue, struct queue_message, node);
+    if (qa->req_clock != qb->req_clock)
+        return qa->req_clock < qb->req_clock;
+    return a < b;
+}
+
+// Move the merge heap entry at 'pos' down to its proper place
+static void
+merge_sift_down(struct steppersync *ss, int count, int pos)
+{
+    int *mh = ss->merge_heap, idx = mh[pos];
+    for (;;) {
+        int child = 2*pos + 1;
+        if (child >= count)
+            break;
+        if (child + 1 < count && merge_before(ss, mh[child + 1], mh[child]))
+            child++;
+        if (!merge_before(ss, mh[child], idx))
+            break;
+        mh[pos] = mh[child];
+        pos = child;
+    }
+    mh[pos] = idx;
+}
+
 // Find and transmit any scheduled steps prior to the given 'move_clock'
-int __visible
-steppersync_flush(struct steppersync *ss, uint64_t move_clock)
+static int
+do_steppersync_flush(struct steppersync *ss, uint64_t move_clock)
 {
     // Flush each stepcompress to the specified move_clock
     int i;
@@ -753,25 +860,23 @@ steppersync_flush(struct steppersync *ss, uint64_t move_clock)
             return ret;
     }
 
-    // Order commands by the reqclock of each pending command
+    // Order commands by the reqclock of each pending command (using a
+    // heap to merge the per-stepper message queues)
+    int *mh = ss->merge_heap, count = 0;
+    for (i=0; i<ss->sc_num; i++)
+        if (!list_empty(&ss->sc_list[i]->msg_queue))
+            mh[count++] = i;
+    for (i=count/2 - 1; i>=0; i--)
+        merge_sift_down(ss, count, i);
     struct list_head msgs;
     list_init(&msgs);
-    for (;;) {
-        // Find message with lowest reqclock
-        uint64_t req_clock = MAX_CLOCK;
-        struct queue_message *qm = NULL;
-        for (i=0; i<ss->sc_num; i++) {
-            struct stepcompress *sc = ss->sc_list[i];
-            if (!list_empty(&sc->msg_queue)) {
-                struct queue_message *m = list_first_entry(
-                    &sc->msg_queue, struct queue_message, node);
-                if (m->req_clock < req_clock) {
-                    qm = m;
-                    req_clock = m->req_clock;
-                }
-            }
-        }
-        if (!qm || (qm->min_clock && req_clock > move_clock))
+    uint32_t msg_count = 0;
+    while (count) {
+        // Message with lowest reqclock is at the top of the heap
+        struct stepcompress *sc = ss->sc_list[mh[0]];
+        struct queue_message *qm = list_first_entry(
+            &sc->msg_queue, struct queue_message, node);
+        if (qm->min_clock && qm->req_clock > move_clock)
             break;
 
         uint64_t next_avail = ss->move_clocks[0];
@@ -786,10 +891,34 @@ steppersync_flush(struct steppersync *ss, uint64_t move_clock)
         // Batch this command
         list_del(&qm->node);
         list_add_tail(&qm->node, &msgs);
+        msg_count++;
+
+        // Update heap with the next message from this stepcompress
+        if (list_empty(&sc->msg_queue))
+            mh[0] = mh[--count];
+        if (count)
+            merge_sift_down(ss, count, 0);
     }
+    ss->flush_count++;
+    ss->flush_msgs += msg_count;
+    if (msg_count > ss->flush_max_msgs)
+        ss->flush_max_msgs = msg_count;
 
     // Transmit commands
     if (!list_empty(&msgs))
         serialqueue_send_batch(ss->sq, ss->cq, &msgs);
     return 0;
 }
+
+// Flush steps (and note the time taken if tracing is enabled)
+int __visible
+steppersync_flush(struct steppersync *ss, uint64_t move_clock)
+{
+    if (!trace_is_active())
+        return do_steppersync_flush(ss, move_clock);
+    double start = get_monotonic();
+    int ret = do_steppersync_flush(ss, move_clock);
+    trace_event(TRACE_STEPPERSYNC_FLUSH, TRACE_PTR_ID(ss->sq), move_clock
+                , get_monotonic() - start);
+    return ret;
+}
@@ -41,5 +41,6 @@ void steppersync_free(struct steppersync *ss);
 void steppersync_set_time(struct steppersync *ss, double time_offset
                           , double mcu_freq);
 int steppersync_flush(struct steppersync *ss, uint64_t move_clock);
+void steppersync_get_stats(struct steppersync *ss, char *buf, int len);
 
 #endif // stepcompress.h
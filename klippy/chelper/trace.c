@@ -0,0 +1,98 @@
+// Lock-free ring buffer of motion pipeline trace events
+//
+// Copyright (C) 2026  The Klipper developers
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "compiler.h" // __visible
+#include "pyhelper.h" // get_monotonic
+#include "trace.h" // trace_event
+
+// Events may be added from any thread (the python thread, the step
+// generation threads, and the serialqueue threads) and are read by
+// the python thread.  Each slot has a sequence number that indicates
+// if it is available for writing (seq == position) or reading (seq ==
+// position + 1).  Events are dropped if the ring is full.
+#define TRACE_SIZE (1 << 16)
+
+struct trace_slot {
+    uint64_t seq;
+    struct trace_record rec;
+};
+
+static struct trace_slot trace_slots[TRACE_SIZE];
+static uint64_t trace_head, trace_tail;
+static uint32_t trace_dropped, trace_initialized;
+uint32_t trace_active;
+
+// Add an event to the ring buffer
+void __visible
+trace_event(uint32_t stage, uint32_t id, double v1, double v2)
+{
+    if (!__atomic_load_n(&trace_active, __ATOMIC_RELAXED))
+        return;
+    double time = get_monotonic();
+    uint64_t pos = __atomic_load_n(&trace_head, __ATOMIC_RELAXED);
+    for (;;) {
+        struct trace_slot *s = &trace_slots[pos & (TRACE_SIZE - 1)];
+        uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&trace_head, &pos, pos + 1, 1
+                                            , __ATOMIC_RELAXED
+                                            , __ATOMIC_RELAXED)) {
+                s->rec.time = time;
+                s->rec.v1 = v1;
+                s->rec.v2 = v2;
+                s->rec.stage = stage;
+                s->rec.id = id;
+                __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+                return;
+            }
+        } else if (seq < pos) {
+            // Ring is full
+            __atomic_fetch_add(&trace_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&trace_head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Start or stop recording events
+void __visible
+trace_enable(int enable)
+{
+    if (enable && !trace_initialized) {
+        int i;
+        for (i=0; i<TRACE_SIZE; i++)
+            trace_slots[i].seq = i;
+        trace_initialized = 1;
+    }
+    __atomic_store_n(&trace_active, !!enable, __ATOMIC_RELAXED);
+}
+
+// Copy up to 'max' events from the ring buffer
+int __visible
+trace_read(struct trace_record *recs, int max)
+{
+    int count = 0;
+    if (!trace_initialized)
+        return 0;
+    while (count < max) {
+        struct trace_slot *s = &trace_slots[trace_tail & (TRACE_SIZE - 1)];
+        uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq != trace_tail + 1)
+            break;
+        recs[count++] = s->rec;
+        __atomic_store_n(&s->seq, trace_tail + TRACE_SIZE, __ATOMIC_RELEASE);
+        trace_tail++;
+    }
+    return count;
+}
+
+// Return the number of events dropped because the ring was full
+uint32_t __visible
+trace_get_dropped(void)
+{
+    return __atomic_load_n(&trace_dropped, __ATOMIC_RELAXED);
+}
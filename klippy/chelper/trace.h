@@ -0,0 +1,42 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h> // uint32_t
+#include "compiler.h" // unlikely
+
+// Trace event stages (see also klippy/extras/motion_trace.py)
+enum {
+    TRACE_MOVE_ADD = 1, TRACE_MOVE_PLAN, TRACE_GEN_STEPS,
+    TRACE_STEPPERSYNC_FLUSH, TRACE_SEND, TRACE_ACK, TRACE_CLOCK,
+};
+
+struct trace_record {
+    double time, v1, v2;
+    uint32_t stage, id;
+};
+
+// Events for a serialqueue use the low bits of its address as the id
+#define TRACE_PTR_ID(p) ((uint32_t)(uintptr_t)(p))
+
+extern uint32_t trace_active;
+
+void trace_event(uint32_t stage, uint32_t id, double v1, double v2);
+void trace_enable(int enable);
+int trace_read(struct trace_record *recs, int max);
+uint32_t trace_get_dropped(void);
+
+static inline int
+trace_is_active(void)
+{
+    return unlikely(__atomic_load_n(&trace_active, __ATOMIC_RELAXED));
+}
+
+// Record an event (if tracing is enabled)
+static inline void
+trace_stamp(uint32_t stage, uint32_t id, double v1, double v2)
+{
+    if (trace_is_active())
+        trace_event(stage, id, v1, v2);
+}
+
+#endif // trace.h
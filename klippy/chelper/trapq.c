@@ -6,20 +6,46 @@
 
 #include <math.h> // sqrt
 #include <stddef.h> // offsetof
+#include <stdio.h> // snprintf
 #include <stdlib.h> // malloc
 #include <string.h> // memset
 #include "compiler.h" // unlikely
 #include "trapq.h" // move_get_coord
 
-// Allocate a new 'move' object
+// Maximum number of released 'struct move' objects kept for reuse
+#define MOVE_POOL_MAX 1024
+
+// Allocate a new 'move' object (reusing a released move if possible)
 struct move *
-move_alloc(void)
+move_alloc(struct trapq *tq)
 {
-    struct move *m = malloc(sizeof(*m));
+    struct move *m;
+    if (!list_empty(&tq->free_moves)) {
+        m = list_first_entry(&tq->free_moves, struct move, node);
+        list_del(&m->node);
+        tq->free_count--;
+    } else {
+        m = malloc(sizeof(*m));
+        tq->malloc_count++;
+    }
     memset(m, 0, sizeof(*m));
+    tq->move_count++;
     return m;
 }
 
+// Release a 'move' object (the move must not be on any list)
+void
+move_free(struct trapq *tq, struct move *m)
+{
+    tq->move_count--;
+    if (tq->free_count >= MOVE_POOL_MAX) {
+        free(m);
+        return;
+    }
+    list_add_head(&m->node, &tq->free_moves);
+    tq->free_count++;
+}
+
 // Fill and add a move to the trapezoid velocity queue
 void __visible
 trapq_append(struct trapq *tq, double print_time
@@ -31,7 +57,7 @@ trapq_append(struct trapq *tq, double print_time
     struct coord start_pos = { .x=start_pos_x, .y=start_pos_y, .z=start_pos_z };
     struct coord axes_r = { .x=axes_r_x, .y=axes_r_y, .z=axes_r_z };
     if (accel_t) {
-        struct move *m = move_alloc();
+        struct move *m = move_alloc(tq);
         m->print_time = print_time;
         m->move_t = accel_t;
         m->start_v = start_v;
@@ -44,7 +70,7 @@ trapq_append(struct trapq *tq, double print_time
         start_pos = move_get_coord(m, accel_t);
     }
     if (cruise_t) {
-        struct move *m = move_alloc();
+        struct move *m = move_alloc(tq);
         m->print_time = print_time;
         m->move_t = cruise_t;
         m->start_v = cruise_v;
@@ -57,7 +83,7 @@ trapq_append(struct trapq *tq, double print_time
         start_pos = move_get_coord(m, cruise_t);
     }
     if (decel_t) {
-        struct move *m = move_alloc();
+        struct move *m = move_alloc(tq);
         m->print_time = print_time;
         m->move_t = decel_t;
         m->start_v = cruise_v;
@@ -68,6 +94,18 @@ trapq_append(struct trapq *tq, double print_time
     }
 }
 
+// Add a batch of moves (possibly on different trapqs) in a single call
+void __visible
+trapq_append_moves(struct push_move *p, int count)
+{
+    struct push_move *end = &p[count];
+    for (; p < end; p++)
+        trapq_append(p->tq, p->print_time, p->accel_t, p->cruise_t, p->decel_t
+                     , p->start_x, p->start_y, p->start_z
+                     , p->x_r, p->y_r, p->z_r
+                     , p->start_v, p->cruise_v, p->accel);
+}
+
 // Return the distance moved given a time in a move
 inline double
 move_get_distance(struct move *m, double move_time)
@@ -96,7 +134,9 @@ trapq_alloc(void)
     memset(tq, 0, sizeof(*tq));
     list_init(&tq->moves);
     list_init(&tq->history);
-    struct move *head_sentinel = move_alloc(), *tail_sentinel = move_alloc();
+    list_init(&tq->free_moves);
+    struct move *head_sentinel = move_alloc(tq);
+    struct move *tail_sentinel = move_alloc(tq);
     tail_sentinel->print_time = tail_sentinel->move_t = NEVER_TIME;
     list_add_head(&head_sentinel->node, &tq->moves);
     list_add_tail(&tail_sentinel->node, &tq->moves);
@@ -117,6 +157,11 @@ trapq_free(struct trapq *tq)
         list_del(&m->node);
         free(m);
     }
+    while (!list_empty(&tq->free_moves)) {
+        struct move *m = list_first_entry(&tq->free_moves, struct move, node);
+        list_del(&m->node);
+        free(m);
+    }
     free(tq);
 }
 
@@ -149,7 +194,7 @@ trapq_add_move(struct trapq *tq, struct move *m)
     struct move *prev = list_prev_entry(tail_sentinel, node);
     if (prev->print_time + prev->move_t < m->print_time) {
         // Add a null move to fill time gap
-        struct move *null_move = move_alloc();
+        struct move *null_move = move_alloc(tq);
         null_move->start_pos = m->start_pos;
         if (!prev->print_time && m->print_time > MAX_NULL_MOVE)
             // Limit the first null move to improve numerical stability
@@ -184,7 +229,7 @@ trapq_finalize_moves(struct trapq *tq, double print_time)
         if (m->start_v || m->half_accel)
             list_add_head(&m->node, &tq->history);
         else
-            free(m);
+            move_free(tq, m);
     }
     // Free old moves from history list
     if (list_empty(&tq->history))
@@ -196,7 +241,7 @@ trapq_finalize_moves(struct trapq *tq, double print_time)
         if (m == latest || m->print_time + m->move_t > expire_time)
             break;
         list_del(&m->node);
-        free(m);
+        move_free(tq, m);
     }
 }
 
@@ -217,11 +262,11 @@ trapq_set_position(struct trapq *tq, double print_time
             break;
         }
         list_del(&m->node);
-        free(m);
+        move_free(tq, m);
     }
 
     // Add a marker to the trapq history
-    struct move *m = move_alloc();
+    struct move *m = move_alloc(tq);
     m->print_time = print_time;
     m->start_pos.x = pos_x;
     m->start_pos.y = pos_y;
@@ -256,3 +301,11 @@ trapq_extract_old(struct trapq *tq, struct pull_move *p, int max
     }
     return res;
 }
+
+// Return a string buffer containing statistics for the trapq
+void __visible
+trapq_get_stats(struct trapq *tq, char *buf, int len)
+{
+    snprintf(buf, len, "trapq_moves=%u trapq_free=%u trapq_mallocs=%u"
+             , tq->move_count, tq->free_count, tq->malloc_count);
+}
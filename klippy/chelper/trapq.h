@@ -1,6 +1,7 @@
 #ifndef TRAPQ_H
 #define TRAPQ_H
 
+#include <stdint.h> // uint32_t
 #include "list.h" // list_node
 
 struct coord {
@@ -21,7 +22,8 @@ struct move {
 };
 
 struct trapq {
-    struct list_head moves, history;
+    struct list_head moves, history, free_moves;
+    uint32_t move_count, free_count, malloc_count;
 };
 
 struct pull_move {
@@ -31,12 +33,22 @@ struct pull_move {
     double x_r, y_r, z_r;
 };
 
-struct move *move_alloc(void);
+struct push_move {
+    struct trapq *tq;
+    double print_time, accel_t, cruise_t, decel_t;
+    double start_x, start_y, start_z;
+    double x_r, y_r, z_r;
+    double start_v, cruise_v, accel;
+};
+
+struct move *move_alloc(struct trapq *tq);
+void move_free(struct trapq *tq, struct move *m);
 void trapq_append(struct trapq *tq, double print_time
                   , double accel_t, double cruise_t, double decel_t
                   , double start_pos_x, double start_pos_y, double start_pos_z
                   , double axes_r_x, double axes_r_y, double axes_r_z
                   , double start_v, double cruise_v, double accel);
+void trapq_append_moves(struct push_move *p, int count);
 double move_get_distance(struct move *m, double move_time);
 struct coord move_get_coord(struct move *m, double move_time);
 struct trapq *trapq_alloc(void);
@@ -48,5 +60,6 @@ void trapq_set_position(struct trapq *tq, double print_time
                         , double pos_x, double pos_y, double pos_z);
 int trapq_extract_old(struct trapq *tq, struct pull_move *p, int max
                       , double start_time, double end_time);
+void trapq_get_stats(struct trapq *tq, char *buf, int len);
 
 #endif // trapq.h
@@ -200,7 +200,7 @@ trdispatch_mcu_alloc(struct trdispatch *td, struct serialqueue *sq
         state_prefix, ARRAY_SIZE(state_prefix));
     memcpy(tdm->fr.prefix, dummy->msg, dummy->len);
     tdm->fr.prefix_len = dummy->len;
-    free(dummy);
+    message_free(dummy);
     tdm->fr.func = handle_trsync_state;
 
     tdm->td = td;
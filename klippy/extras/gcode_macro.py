@@ -13,10 +13,37 @@ import jinja2
 
 # Wrapper for access to printer object get_status() methods
 class GetStatusWrapper:
-    def __init__(self, printer, eventtime=None):
+    def __init__(self, printer, eventtime=None, copy_cache=None):
         self.printer = printer
         self.eventtime = eventtime
         self.cache = {}
+        if copy_cache is None:
+            copy_cache = {}
+        self.copy_cache = copy_cache
+    def _copy_status(self, sval, status):
+        # Templates get a copy of the status.  Copying large containers
+        # (such as the configfile settings) is slow, so the copies made
+        # by earlier renders are reused if they are still equal to the
+        # current status.
+        copy_cache = self.copy_cache.setdefault(sval, {})
+        res = {}
+        for key, val in status.items():
+            if not isinstance(val, (dict, list)):
+                res[key] = copy.deepcopy(val)
+                continue
+            prev = copy_cache.get(key)
+            if prev is not None:
+                orig, tcopy = prev
+                try:
+                    is_same = val == orig and tcopy == orig
+                except Exception:
+                    is_same = False
+                if is_same:
+                    res[key] = tcopy
+                    continue
+            res[key] = tcopy = copy.deepcopy(val)
+            copy_cache[key] = (copy.deepcopy(val), tcopy)
+        return res
     def __getitem__(self, val):
         sval = str(val).strip()
         if sval in self.cache:
@@ -26,7 +53,8 @@ class GetStatusWrapper:
             raise KeyError(val)
         if self.eventtime is None:
             self.eventtime = self.printer.get_reactor().monotonic()
-        self.cache[sval] = res = copy.deepcopy(po.get_status(self.eventtime))
+        status = po.get_status(self.eventtime)
+        self.cache[sval] = res = self._copy_status(sval, status)
         return res
     def __contains__(self, val):
         try:
@@ -72,6 +100,7 @@ class PrinterGCodeMacro:
     def __init__(self, config):
         self.printer = config.get_printer()
         self.env = jinja2.Environment('{%', '%}', '{', '}')
+        self.status_copy_cache = {}
     def load_template(self, config, option, default=None):
         name = "%s:%s" % (config.get_name(), option)
         if default is None:
@@ -96,7 +125,8 @@ class PrinterGCodeMacro:
         return ""
     def create_template_context(self, eventtime=None):
         return {
-            'printer': GetStatusWrapper(self.printer, eventtime),
+            'printer': GetStatusWrapper(self.printer, eventtime,
+                                        self.status_copy_cache),
             'action_emergency_stop': self._action_emergency_stop,
             'action_respond_info': self._action_respond_info,
             'action_raise_error': self._action_raise_error,
@@ -0,0 +1,26 @@
+# Support for a shared micro-controller communication thread
+#
+# Copyright (C) 2026  The Klipper developers
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import chelper
+
+class PrinterIOThread:
+    def __init__(self, config):
+        self.printer = config.get_printer()
+        self.cpu = config.getint('cpu', None, minval=0)
+        self.priority = config.getint('priority', 0, minval=0, maxval=99)
+        self.engine = None
+    def get_engine(self):
+        if self.engine is None:
+            ffi_main, ffi_lib = chelper.get_ffi()
+            cpu = self.cpu if self.cpu is not None else -1
+            engine = ffi_lib.serialqueue_engine_alloc(cpu, self.priority)
+            if engine == ffi_main.NULL:
+                raise self.printer.config_error(
+                    "Unable to start io_thread background thread")
+            self.engine = ffi_main.gc(engine, ffi_lib.serialqueue_engine_free)
+        return self.engine
+
+def load_config(config):
+    return PrinterIOThread(config)
@@ -0,0 +1,123 @@
+# Tracing of moves through the motion pipeline
+#
+# Copyright (C) 2026  The Klipper developers
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import os, json, struct, logging
+import chelper
+
+# The trace file starts with TRACE_MAGIC, followed by a 32bit length
+# and a json header, followed by the trace records (see
+# klippy/chelper/trace.h).  Use scripts/motion_trace.py to analyze it.
+TRACE_MAGIC = b'KLTRACE\n'
+TRACE_RECORD_FORMAT = '<dddII'
+TRACE_STAGES = ["", "move_add", "move_plan", "gen_steps",
+                "steppersync_flush", "send", "ack", "clock"]
+TRACE_CLOCK = 7
+
+DRAIN_TIME = 0.100
+READ_COUNT = 4096
+
+class MotionTrace:
+    def __init__(self, config):
+        self.printer = config.get_printer()
+        self.reactor = self.printer.get_reactor()
+        self.filename = os.path.expanduser(
+            config.get('filename', '/tmp/klippy_trace.bin'))
+        self.ffi_main, self.ffi_lib = chelper.get_ffi()
+        self.records = self.ffi_main.new('struct trace_record[%d]'
+                                         % (READ_COUNT,))
+        self.record_size = self.ffi_main.sizeof('struct trace_record')
+        self.trace_file = None
+        self.trace_mcus = []
+        self.record_count = self.start_dropped = 0
+        self.drain_timer = self.reactor.register_timer(self._drain)
+        self.printer.register_event_handler("klippy:disconnect",
+                                            self._handle_disconnect)
+        # Register commands
+        gcode = self.printer.lookup_object('gcode')
+        gcode.register_command("MOTION_TRACE_START",
+                               self.cmd_MOTION_TRACE_START,
+                               desc=self.cmd_MOTION_TRACE_START_help)
+        gcode.register_command("MOTION_TRACE_STOP",
+                               self.cmd_MOTION_TRACE_STOP,
+                               desc=self.cmd_MOTION_TRACE_STOP_help)
+    def _handle_disconnect(self):
+        if self.trace_file is not None:
+            self.stop()
+    # Trace record handling
+    def _write_records(self):
+        while 1:
+            count = self.ffi_lib.trace_read(self.records, READ_COUNT)
+            if not count:
+                return
+            if self.trace_file is not None:
+                self.trace_file.write(self.ffi_main.buffer(
+                    self.records, count * self.record_size))
+                self.record_count += count
+    def _drain(self, eventtime):
+        # Note the print time to clock conversion of each mcu
+        for m, trace_id in self.trace_mcus:
+            est_print_time = m.estimated_print_time(eventtime)
+            self.ffi_lib.trace_event(TRACE_CLOCK, trace_id, est_print_time,
+                                     m.print_time_to_clock(est_print_time))
+        self._write_records()
+        return eventtime + DRAIN_TIME
+    # Start and stop
+    def start(self, filename):
+        if self.trace_file is not None:
+            raise self.printer.command_error("Motion trace already running")
+        mcus = self.printer.lookup_objects(module='mcu')
+        self.trace_mcus = [(m, m.get_trace_id()) for n, m in mcus]
+        header = {
+            'record_format': TRACE_RECORD_FORMAT, 'stages': TRACE_STAGES,
+            'mcus': [{'name': m.get_name(), 'id': trace_id,
+                      'freq': m.seconds_to_clock(1.)}
+                     for m, trace_id in self.trace_mcus]}
+        data = json.dumps(header).encode()
+        try:
+            f = open(filename, 'wb')
+            f.write(TRACE_MAGIC + struct.pack('<I', len(data)) + data)
+        except IOError as e:
+            raise self.printer.command_error(
+                "Unable to open trace file %s: %s" % (filename, str(e)))
+        # Discard any events left over from an earlier trace
+        self._write_records()
+        self.trace_file = f
+        self.record_count = 0
+        self.start_dropped = self.ffi_lib.trace_get_dropped()
+        self.ffi_lib.trace_enable(1)
+        toolhead = self.printer.lookup_object('toolhead')
+        toolhead.set_trace_callback(self.ffi_lib.trace_event)
+        self.reactor.update_timer(self.drain_timer, self.reactor.NOW)
+    def stop(self):
+        if self.trace_file is None:
+            raise self.printer.command_error("Motion trace not running")
+        toolhead = self.printer.lookup_object('toolhead')
+        toolhead.set_trace_callback(None)
+        self.ffi_lib.trace_enable(0)
+        self.reactor.update_timer(self.drain_timer, self.reactor.NEVER)
+        self._write_records()
+        filename = self.trace_file.name
+        self.trace_file.close()
+        self.trace_file = None
+        dropped = self.ffi_lib.trace_get_dropped() - self.start_dropped
+        if dropped:
+            logging.info("Motion trace dropped %d events", dropped)
+        return filename, self.record_count, dropped
+    def get_status(self, eventtime):
+        return {'active': self.trace_file is not None}
+    # G-Code commands
+    cmd_MOTION_TRACE_START_help = "Start recording a motion pipeline trace"
+    def cmd_MOTION_TRACE_START(self, gcmd):
+        filename = os.path.expanduser(gcmd.get('FILENAME', self.filename))
+        self.start(filename)
+        gcmd.respond_info("Motion trace started")
+    cmd_MOTION_TRACE_STOP_help = "Stop recording a motion pipeline trace"
+    def cmd_MOTION_TRACE_STOP(self, gcmd):
+        filename, count, dropped = self.stop()
+        gcmd.respond_info("Motion trace wrote %d events to %s"
+                          " (%d dropped)" % (count, filename, dropped))
+
+def load_config(config):
+    return MotionTrace(config)
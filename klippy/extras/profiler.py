@@ -0,0 +1,129 @@
+# Sampling profiler for the host software
+#
+# Copyright (C) 2026  The Klipper developers
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, threading, logging
+
+# The profiler runs a background thread that periodically records the
+# python stack of the main (reactor) thread.  Each sample is attributed
+# to the reactor timer callback that was running (or "reactor" for fd
+# callbacks and idle time).  Time spent in C helper code is attributed
+# to the python line that called it.  The samples are written in the
+# "collapsed stack" format used by flame graph tools.
+class PrinterProfiler:
+    def __init__(self, config):
+        self.printer = config.get_printer()
+        self.reactor = self.printer.get_reactor()
+        self.interval = config.getfloat('interval', .010,
+                                        minval=.001, maxval=1.)
+        self.filename = os.path.expanduser(
+            config.get('filename', '/tmp/klippy_profile.txt'))
+        self.main_thread_id = threading.current_thread().ident
+        self.sample_thread = None
+        self.stop_event = threading.Event()
+        self.stacks = {}
+        self.code_names = {}
+        self.printer.register_event_handler("klippy:disconnect",
+                                            self._handle_disconnect)
+        # Register commands
+        gcode = self.printer.lookup_object('gcode')
+        gcode.register_command("PROFILER_START", self.cmd_PROFILER_START,
+                               desc=self.cmd_PROFILER_START_help)
+        gcode.register_command("PROFILER_STOP", self.cmd_PROFILER_STOP,
+                               desc=self.cmd_PROFILER_STOP_help)
+        webhooks = self.printer.lookup_object('webhooks')
+        webhooks.register_endpoint("profiler/start",
+                                   self._handle_start_request)
+        webhooks.register_endpoint("profiler/stop", self._handle_stop_request)
+    def _handle_disconnect(self):
+        if self.sample_thread is not None:
+            self._stop_thread()
+    # Sampling
+    def _get_code_name(self, code):
+        name = self.code_names.get(code)
+        if name is None:
+            name = "%s (%s)" % (code.co_name,
+                                os.path.basename(code.co_filename))
+            self.code_names[code] = name
+        return name
+    def _sample(self):
+        frame = sys._current_frames().get(self.main_thread_id)
+        if frame is None:
+            return
+        code = frame.f_code
+        stack = ["%s (%s:%d)" % (code.co_name,
+                                 os.path.basename(code.co_filename),
+                                 frame.f_lineno)]
+        frame = frame.f_back
+        while frame is not None:
+            stack.append(self._get_code_name(frame.f_code))
+            frame = frame.f_back
+        stack.append(self.reactor.get_running_timer() or "reactor")
+        key = tuple(reversed(stack))
+        self.stacks[key] = self.stacks.get(key, 0) + 1
+    def _sample_loop(self, interval):
+        while not self.stop_event.wait(interval):
+            try:
+                self._sample()
+            except:
+                logging.exception("profiler sample error")
+                return
+    def _stop_thread(self):
+        self.stop_event.set()
+        self.sample_thread.join()
+        self.sample_thread = None
+    # Start and stop
+    def start(self, interval=None):
+        if self.sample_thread is not None:
+            raise self.printer.command_error("Profiler already running")
+        if interval is None:
+            interval = self.interval
+        self.stacks = {}
+        self.stop_event.clear()
+        self.sample_thread = threading.Thread(target=self._sample_loop,
+                                              args=(interval,))
+        self.sample_thread.daemon = True
+        self.sample_thread.start()
+    def stop(self, filename=None):
+        if self.sample_thread is None:
+            raise self.printer.command_error("Profiler not running")
+        self._stop_thread()
+        if filename is None:
+            filename = self.filename
+        filename = os.path.expanduser(filename)
+        stacks = sorted([(";".join(k), c) for k, c in self.stacks.items()])
+        self.stacks = {}
+        try:
+            with open(filename, 'w') as f:
+                for stack, count in stacks:
+                    f.write("%s %d\n" % (stack, count))
+        except IOError as e:
+            raise self.printer.command_error(
+                "Unable to write profile %s: %s" % (filename, str(e)))
+        return filename, sum([c for s, c in stacks])
+    def get_status(self, eventtime):
+        return {'active': self.sample_thread is not None}
+    # G-Code and webhooks interface
+    cmd_PROFILER_START_help = "Start the host software sampling profiler"
+    def cmd_PROFILER_START(self, gcmd):
+        interval = gcmd.get_float('INTERVAL', self.interval,
+                                  minval=.001, maxval=1.)
+        self.start(interval)
+        gcmd.respond_info("Profiler started")
+    cmd_PROFILER_STOP_help = "Stop the profiler and write the samples"
+    def cmd_PROFILER_STOP(self, gcmd):
+        filename, count = self.stop(gcmd.get('FILENAME', None))
+        gcmd.respond_info("Profiler wrote %d samples to %s"
+                          % (count, filename))
+    def _handle_start_request(self, web_request):
+        interval = web_request.get_float('interval', self.interval)
+        if interval < .001 or interval > 1.:
+            raise web_request.error("Invalid profiler interval")
+        self.start(interval)
+    def _handle_stop_request(self, web_request):
+        filename, count = self.stop(web_request.get_str('filename', None))
+        web_request.send({'filename': filename, 'samples': count})
+
+def load_config(config):
+    return PrinterProfiler(config)
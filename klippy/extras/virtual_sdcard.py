@@ -3,9 +3,159 @@
 # Copyright (C) 2018  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import os, logging
+import os, codecs, struct, logging
 
-VALID_GCODE_EXTS = ['gcode', 'g', 'gco']
+VALID_GCODE_EXTS = ['gcode', 'g', 'gco', 'kjob']
+
+READ_AHEAD = 1024 * 1024
+
+# Read a g-code file.  The kernel is asked to load the data ahead of
+# the current position in the background (when supported).
+class GCodeFile:
+    def __init__(self, filename):
+        self.name = filename
+        self.file = open(filename, 'rb')
+        self.fd = self.file.fileno()
+        self.size = os.fstat(self.fd).st_size
+        self.data_offset = 0
+        self.position = self.readahead_pos = 0
+        self.can_advise = hasattr(os, 'posix_fadvise')
+        if self.can_advise:
+            os.posix_fadvise(self.fd, 0, 0, os.POSIX_FADV_SEQUENTIAL)
+        self.decoder = None
+        if str is not bytes:
+            self.decoder = codecs.getincrementaldecoder('utf-8')('replace')
+    def close(self):
+        self.file.close()
+    def tell(self):
+        return self.position
+    def seek(self, pos):
+        self.position = self.readahead_pos = pos
+        if self.decoder is not None:
+            self.decoder.reset()
+    def _pread(self, pos, size):
+        if hasattr(os, 'pread'):
+            return os.pread(self.fd, size, self.data_offset + pos)
+        self.file.seek(self.data_offset + pos)
+        return self.file.read(size)
+    def _read_ahead(self):
+        start = max(self.position, self.readahead_pos)
+        end = min(self.position + READ_AHEAD, self.size)
+        if (not self.can_advise or start >= end
+            or (end - start < READ_AHEAD // 2 and end < self.size)):
+            return
+        os.posix_fadvise(self.fd, self.data_offset + start, end - start,
+                         os.POSIX_FADV_WILLNEED)
+        self.readahead_pos = end
+    def _read_chunk(self, size):
+        pos = self.position
+        size = min(size, self.size - pos)
+        data = self._pread(pos, size)
+        if len(data) < size:
+            # File was truncated
+            self.size = pos + len(data)
+        elif pos + size < self.size:
+            eol = data.rfind(b'\n')
+            if eol >= 0:
+                data = data[:eol+1]
+        self.position = pos + len(data)
+        self._read_ahead()
+        if self.decoder is not None:
+            data = self.decoder.decode(data, self.position >= self.size)
+        return data
+    def read(self, size):
+        # Read up to 'size' bytes - the data ends at a newline if possible.
+        # An empty string is only returned at the end of the file.
+        data = ""
+        while not data and self.position < self.size:
+            data = self._read_chunk(size)
+        return data
+    def read_at(self, pos, size):
+        # Read data without changing the print position
+        data = self._pread(pos, max(0, min(size, self.size - pos)))
+        if str is not bytes:
+            data = data.decode('utf-8', 'replace')
+        return data
+    def get_moves(self, count):
+        # Moves are parsed from the text of the file
+        return None
+    def get_layer_position(self, layer):
+        return None
+
+# Compiled g-code job files (as created by scripts/compile_gcode.py).  A
+# job file contains the original g-code text along with the offset of
+# each line, the results of the C move parser for each line, the
+# offset of each layer, and the locations of each object (as a json
+# list of [name, start, end] entries).
+JOB_MAGIC = b'KLIPJOB\n'
+JOB_VERSION = 1
+# magic, version, flags, text_offset, text_size, line_count, lines_offset,
+# records_offset, layer_count, layers_offset, objects_offset, objects_size
+JOB_HEADER = struct.Struct('<8sIIQQQQQQQQQ')
+JOB_RECORD = struct.Struct('<6d')
+JOB_OFFSET = struct.Struct('<Q')
+
+class GCodeJobFile(GCodeFile):
+    def __init__(self, filename):
+        GCodeFile.__init__(self, filename)
+        header = self.file.read(JOB_HEADER.size)
+        if len(header) != JOB_HEADER.size:
+            raise IOError("Truncated job file header")
+        (magic, version, flags, self.data_offset, self.size,
+         self.line_count, self.lines_offset, self.records_offset,
+         self.layer_count, self.layers_offset, objects_offset,
+         objects_size) = JOB_HEADER.unpack(header)
+        if magic != JOB_MAGIC or version != JOB_VERSION:
+            raise IOError("Unsupported job file version")
+        self.line = self.chunk_line = 0
+        self.line_synced = self.chunk_synced = True
+    def _read_offset(self, table_offset, index):
+        self.file.seek(table_offset + index * JOB_OFFSET.size)
+        return JOB_OFFSET.unpack(self.file.read(JOB_OFFSET.size))[0]
+    def seek(self, pos):
+        GCodeFile.seek(self, pos)
+        # Binary search for the line containing the new position
+        low, high = 0, self.line_count
+        while high - low > 1:
+            mid = (low + high) // 2
+            if self._read_offset(self.lines_offset, mid) <= pos:
+                low = mid
+            else:
+                high = mid
+        self.line = low
+        self.line_synced = (self.line_count and pos == self._read_offset(
+            self.lines_offset, low))
+    def read(self, size):
+        self.chunk_line = self.line
+        self.chunk_synced = self.line_synced
+        data = GCodeFile.read(self, size)
+        newlines = data.count('\n')
+        if newlines:
+            self.line += newlines
+            self.line_synced = True
+        return data
+    def get_moves(self, count):
+        # Return the parsed moves for the lines of the last read
+        if self.chunk_line + count > self.line_count:
+            return None
+        self.file.seek(self.records_offset + self.chunk_line * JOB_RECORD.size)
+        data = self.file.read(count * JOB_RECORD.size)
+        moves = list(struct.unpack('<%dd' % (count * 6,), data))
+        if count and not self.chunk_synced:
+            # The first line was not read from its start
+            moves[0] = -1.
+        return moves
+    def get_layer_position(self, layer):
+        if layer < 1 or layer > self.layer_count:
+            return None
+        return self._read_offset(self.layers_offset, layer - 1)
+
+def open_gcode_file(filename):
+    with open(filename, 'rb') as f:
+        magic = f.read(len(JOB_MAGIC))
+    if magic == JOB_MAGIC:
+        return GCodeJobFile(filename)
+    return GCodeFile(filename)
 
 class VirtualSD:
     def __init__(self, config):
@@ -46,8 +196,7 @@ class VirtualSD:
             try:
                 readpos = max(self.file_position - 1024, 0)
                 readcount = self.file_position - readpos
-                self.current_file.seek(readpos)
-                data = self.current_file.read(readcount + 128)
+                data = self.current_file.read_at(readpos, readcount + 128)
             except:
                 logging.exception("virtual_sdcard shutdown read")
                 return
@@ -145,9 +294,18 @@ class VirtualSD:
             raise gcmd.error("SD busy")
         self._reset_file()
         filename = gcmd.get("FILENAME")
+        layer = gcmd.get_int("LAYER", None, minval=1)
         if filename[0] == '/':
             filename = filename[1:]
         self._load_file(gcmd, filename, check_subdirs=True)
+        if layer is not None:
+            # Start at the given layer of a compiled job file
+            pos = self.current_file.get_layer_position(layer)
+            if pos is None:
+                self._reset_file()
+                raise gcmd.error("Layer %d not found in '%s'"
+                                 % (layer, filename))
+            self.file_position = pos
         self.do_resume()
     def cmd_M20(self, gcmd):
         # List SD card
@@ -177,10 +335,8 @@ class VirtualSD:
             if fname not in flist:
                 fname = files_by_lower[fname.lower()]
             fname = os.path.join(self.sdcard_dirname, fname)
-            f = open(fname, 'r')
-            f.seek(0, os.SEEK_END)
-            fsize = f.tell()
-            f.seek(0)
+            f = open_gcode_file(fname)
+            fsize = f.size
         except:
             logging.exception("virtual_sdcard file open")
             raise gcmd.error("Unable to open file")
@@ -229,9 +385,11 @@ class VirtualSD:
         gcode_mutex = self.gcode.get_mutex()
         partial_input = ""
         lines = []
+        line_index = 0
+        moves = []
         error_message = None
         while not self.must_pause_work:
-            if not lines:
+            if line_index >= len(lines):
                 # Read more data
                 try:
                     data = self.current_file.read(8192)
@@ -248,7 +406,11 @@ class VirtualSD:
                 lines = data.split('\n')
                 lines[0] = partial_input + lines[0]
                 partial_input = lines.pop()
-                lines.reverse()
+                line_index = 0
+                moves = self.current_file.get_moves(len(lines))
+                if moves is None:
+                    # Find simple G0/G1 moves so they need not be reparsed
+                    moves = self.gcode.parse_moves(lines)
                 self.reactor.pause(self.reactor.NOW)
                 continue
             # Pause if any other request is pending in the gcode class
@@ -257,11 +419,15 @@ class VirtualSD:
                 continue
             # Dispatch command
             self.cmd_from_sd = True
-            line = lines.pop()
+            line = lines[line_index]
             next_file_position = self.file_position + len(line) + 1
             self.next_file_position = next_file_position
             try:
-                self.gcode.run_script(line)
+                if moves[line_index*6] >= 0.:
+                    with gcode_mutex:
+                        self.gcode.run_move(line, moves, line_index)
+                else:
+                    self.gcode.run_script(line)
             except self.gcode.error as e:
                 error_message = str(e)
                 try:
@@ -274,6 +440,7 @@ class VirtualSD:
                 break
             self.cmd_from_sd = False
             self.file_position = self.next_file_position
+            line_index += 1
             # Do we need to skip around?
             if self.next_file_position != next_file_position:
                 try:
@@ -283,6 +450,7 @@ class VirtualSD:
                     self.work_timer = None
                     return self.reactor.NEVER
                 lines = []
+                line_index = 0
                 partial_input = ""
         logging.info("Exiting SD card print (position %d)", self.file_position)
         self.work_timer = None
@@ -4,6 +4,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import os, re, logging, collections, shlex
+import chelper
 
 class CommandError(Exception):
     pass
@@ -12,20 +13,33 @@ Coord = collections.namedtuple('Coord', ('x', 'y', 'z', 'e'))
 
 class GCodeCommand:
     error = CommandError
-    def __init__(self, gcode, command, commandline, params, need_ack):
+    def __init__(self, gcode, command, commandline, params, need_ack,
+                 move_params=None):
         self._command = command
         self._commandline = commandline
         self._params = params
+        self._move_params = move_params
         self._need_ack = need_ack
         # Method wrappers
         self.respond_info = gcode.respond_info
         self.respond_raw = gcode.respond_raw
+        self._parse_line = gcode._parse_line
     def get_command(self):
         return self._command
     def get_commandline(self):
         return self._commandline
     def get_command_parameters(self):
+        if self._params is None:
+            # Moves parsed by the C code only create params on demand
+            self._params = self._parse_line(self._commandline)[1]
         return self._params
+    def get_move_parameters(self):
+        # Return the X, Y, Z, E, F parameters (or None if not present).
+        # Values may be strings or floats.
+        if self._move_params is None:
+            params = self.get_command_parameters()
+            self._move_params = [params.get(a) for a in 'XYZEF']
+        return self._move_params
     def get_raw_command_parameters(self):
         command = self._command
         if command.startswith("M117 ") or command.startswith("M118 "):
@@ -54,7 +68,7 @@ class GCodeCommand:
     class sentinel: pass
     def get(self, name, default=sentinel, parser=str, minval=None, maxval=None,
             above=None, below=None):
-        value = self._params.get(name)
+        value = self.get_command_parameters().get(name)
         if value is None:
             if default is self.sentinel:
                 raise self.error("Error on '%s': missing %s"
@@ -104,6 +118,10 @@ class GCodeDispatch:
         self.ready_gcode_handlers = {}
         self.mux_commands = {}
         self.gcode_help = {}
+        # C move parser
+        self.ffi_main, self.ffi_lib = chelper.get_ffi()
+        self.move_records = self.ffi_main.new('double[]', 0)
+        self.move_records_count = 0
         # Register commands needed before config file is loaded
         handlers = ['M110', 'M112', 'M115',
                     'RESTART', 'FIRMWARE_RESTART', 'ECHO', 'STATUS', 'HELP']
@@ -172,43 +190,83 @@ class GCodeDispatch:
         self._respond_state("Ready")
     # Parse input into commands
     args_r = re.compile('([A-Z_]+|[A-Z*/])')
+    def _parse_line(self, line):
+        # Ignore comments
+        cpos = line.find(';')
+        if cpos >= 0:
+            line = line[:cpos]
+        # Break line into parts and determine command
+        parts = self.args_r.split(line.upper())
+        numparts = len(parts)
+        cmd = ""
+        if numparts >= 3 and parts[1] != 'N':
+            cmd = parts[1] + parts[2].strip()
+        elif numparts >= 5 and parts[1] == 'N':
+            # Skip line number at start of command
+            cmd = parts[3] + parts[4].strip()
+        # Build gcode "params" dictionary
+        params = { parts[i]: parts[i+1].strip()
+                   for i in range(1, numparts, 2) }
+        return cmd, params
+    def parse_moves(self, commands):
+        # Use the C parser to find simple G0/G1 moves.  Each line has a
+        # record of six values: the command (0 for G0, 1 for G1, or -1
+        # for other lines) followed by the X, Y, Z, E, F parameters.
+        count = len(commands)
+        if count > self.move_records_count:
+            self.move_records_count = max(count, 2 * self.move_records_count)
+            self.move_records = self.ffi_main.new(
+                'double[]', 6 * self.move_records_count)
+        data = '\n'.join(commands)
+        if not isinstance(data, bytes):
+            data = data.encode('utf-8', 'replace')
+        res = self.ffi_lib.gcode_parse_moves(data, len(data),
+                                             self.move_records, count)
+        if res != count:
+            # A command contains a newline - use the python parser
+            return [-1.] * (6 * count)
+        return self.ffi_main.unpack(self.move_records, 6 * count)
+    def _create_move_command(self, commandline, moves, index, need_ack):
+        pos = index * 6
+        cmd = "G1" if moves[pos] else "G0"
+        move_params = [v if v == v else None for v in moves[pos+1:pos+6]]
+        return GCodeCommand(self, cmd, commandline, None, need_ack,
+                            move_params)
+    def _run_command(self, gcmd, need_ack):
+        # Invoke handler for command
+        cmd = gcmd.get_command()
+        handler = self.gcode_handlers.get(cmd, self.cmd_default)
+        try:
+            handler(gcmd)
+        except self.error as e:
+            self._respond_error(str(e))
+            self.printer.send_event("gcode:command_error")
+            if not need_ack:
+                raise
+        except:
+            msg = 'Internal error on command:"%s"' % (cmd,)
+            logging.exception(msg)
+            self.printer.invoke_shutdown(msg)
+            self._respond_error(msg)
+            if not need_ack:
+                raise
+        gcmd.ack()
     def _process_commands(self, commands, need_ack=True):
-        for line in commands:
-            # Ignore comments and leading/trailing spaces
-            line = origline = line.strip()
-            cpos = line.find(';')
-            if cpos >= 0:
-                line = line[:cpos]
-            # Break line into parts and determine command
-            parts = self.args_r.split(line.upper())
-            numparts = len(parts)
-            cmd = ""
-            if numparts >= 3 and parts[1] != 'N':
-                cmd = parts[1] + parts[2].strip()
-            elif numparts >= 5 and parts[1] == 'N':
-                # Skip line number at start of command
-                cmd = parts[3] + parts[4].strip()
-            # Build gcode "params" dictionary
-            params = { parts[i]: parts[i+1].strip()
-                       for i in range(1, numparts, 2) }
-            gcmd = GCodeCommand(self, cmd, origline, params, need_ack)
-            # Invoke handler for command
-            handler = self.gcode_handlers.get(cmd, self.cmd_default)
-            try:
-                handler(gcmd)
-            except self.error as e:
-                self._respond_error(str(e))
-                self.printer.send_event("gcode:command_error")
-                if not need_ack:
-                    raise
-            except:
-                msg = 'Internal error on command:"%s"' % (cmd,)
-                logging.exception(msg)
-                self.printer.invoke_shutdown(msg)
-                self._respond_error(msg)
-                if not need_ack:
-                    raise
-            gcmd.ack()
+        moves = self.parse_moves(commands)
+        for i, line in enumerate(commands):
+            # Ignore leading/trailing spaces
+            origline = line.strip()
+            if moves[i*6] >= 0.:
+                gcmd = self._create_move_command(origline, moves, i, need_ack)
+            else:
+                cmd, params = self._parse_line(origline)
+                gcmd = GCodeCommand(self, cmd, origline, params, need_ack)
+            self._run_command(gcmd, need_ack)
+    def run_move(self, line, moves, index):
+        # Run a G0/G1 command that was found by parse_moves() without
+        # parsing it again.  The caller must hold the gcode mutex.
+        gcmd = self._create_move_command(line.strip(), moves, index, False)
+        self._run_command(gcmd, False)
     def run_script_from_command(self, script):
         self._process_commands(script.split('\n'), need_ack=False)
     def run_script(self, script):
@@ -252,8 +310,9 @@ class GCodeDispatch:
         try:
             eparams = [earg.split('=', 1) for earg in shlex.split(eargs)]
             eparams = { k.upper(): v for k, v in eparams }
-            gcmd._params.clear()
-            gcmd._params.update(eparams)
+            params = gcmd.get_command_parameters()
+            params.clear()
+            params.update(eparams)
             return gcmd
         except ValueError as e:
             raise self.error("Malformed command '%s'"
@@ -584,6 +584,7 @@ class MCU:
         self._stepqueues = []
         self._steppersync = None
         # Stats
+        self._stats_buf = ffi_main.new('char[256]')
         self._get_status_info = {}
         self._stats_sumsq_base = 0.
         self._mcu_tick_avg = 0.
@@ -764,6 +765,9 @@ class MCU:
             if resmeth == 'rpi_usb' and not os.path.exists(self._serialport):
                 # Try toggling usb power
                 self._check_restart("enable power")
+            iothread = self._printer.lookup_object('io_thread', None)
+            if iothread is not None:
+                self._serial.set_io_engine(iothread.get_engine())
             try:
                 if self._canbus_iface is not None:
                     cbid = self._printer.lookup_object('canbus_ids')
@@ -868,6 +872,12 @@ class MCU:
         return self._serial.get_msgparser().get_constants()
     def get_constant_float(self, name):
         return self._serial.get_msgparser().get_constant_float(name)
+    def get_trace_id(self):
+        # Events for this mcu in a motion trace use the low bits of the
+        # serialqueue address as an id (see klippy/chelper/trace.h)
+        ffi_main, ffi_lib = chelper.get_ffi()
+        sq = ffi_main.cast('uintptr_t', self._serial.serialqueue)
+        return int(sq) & 0xffffffff
     def print_time_to_clock(self, print_time):
         return self._clocksync.print_time_to_clock(print_time)
     def clock_to_print_time(self, clock):
@@ -968,6 +978,11 @@ class MCU:
             self._mcu_tick_awake, self._mcu_tick_avg, self._mcu_tick_stddev)
         stats = ' '.join([load, self._serial.stats(eventtime),
                           self._clocksync.stats(eventtime)])
+        if self._steppersync is not None:
+            ffi_main, ffi_lib = chelper.get_ffi()
+            ffi_lib.steppersync_get_stats(self._steppersync, self._stats_buf,
+                                          len(self._stats_buf))
+            stats += ' ' + str(ffi_main.string(self._stats_buf).decode())
         parts = [s.split('=', 1) for s in stats.split()]
         last_stats = {k:(float(v) if '.' in v else int(v)) for k, v in parts}
         self._get_status_info['last_stats'] = last_stats
@@ -3,7 +3,7 @@
 # Copyright (C) 2016-2020  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import os, gc, select, math, time, logging, queue
+import os, gc, select, math, time, logging, queue, heapq, bisect
 import greenlet
 import chelper, util
 
@@ -11,9 +11,65 @@ _NOW = 0.
 _NEVER = 9999999999999999.
 
 class ReactorTimer:
-    def __init__(self, callback, waketime):
+    def __init__(self, callback, waketime, timer_stats):
         self.callback = callback
         self.waketime = waketime
+        self.timer_stats = timer_stats
+        self.is_registered = True
+        self.heap_seq = 0 # sequence id of the timer's entry in the heap
+
+# Histogram bucket limits (in seconds) for timer lateness and run time
+TIMER_HIST = [.001, .005, .025, .100]
+# Length (in seconds) of the windows tracked for the periodic stats
+TIMER_STATS_WINDOW = 1.
+# Number of timer callbacks to report in the periodic stats
+TIMER_STATS_TOP = 3
+
+# Statistics for all the timers of a given callback
+class ReactorTimerStats:
+    def __init__(self, name):
+        self.name = name
+        self.count = 0
+        self.run_time = self.run_max = self.late_max = 0.
+        self.run_hist = [0] * (len(TIMER_HIST) + 1)
+        self.late_hist = [0] * (len(TIMER_HIST) + 1)
+        # Calls, run_max, and late_max of the current and prior window
+        self.window_end = 0.
+        self.window = [0, 0., 0.]
+        self.last_window = [0, 0., 0.]
+    def note(self, late, run_time, eventtime):
+        self.count += 1
+        self.run_time += run_time
+        self.run_hist[bisect.bisect(TIMER_HIST, run_time)] += 1
+        self.late_hist[bisect.bisect(TIMER_HIST, late)] += 1
+        self.run_max = max(self.run_max, run_time)
+        self.late_max = max(self.late_max, late)
+        if eventtime >= self.window_end:
+            if eventtime < self.window_end + TIMER_STATS_WINDOW:
+                self.last_window = self.window
+            else:
+                self.last_window = [0, 0., 0.]
+            self.window = [0, 0., 0.]
+            self.window_end = eventtime + TIMER_STATS_WINDOW
+        w = self.window
+        w[0] += 1
+        w[1] = max(w[1], run_time)
+        w[2] = max(w[2], late)
+    def get_recent(self, eventtime):
+        # Return (calls, run_max, late_max) over the last one or two windows
+        if eventtime >= self.window_end + TIMER_STATS_WINDOW:
+            return 0, 0., 0.
+        w = self.window
+        if eventtime >= self.window_end:
+            return tuple(w)
+        lw = self.last_window
+        return w[0] + lw[0], max(w[1], lw[1]), max(w[2], lw[2])
+    def get_info(self):
+        return ("%s: calls=%d run_total=%.3f run_max=%.6f late_max=%.6f"
+                " run_hist=%s late_hist=%s" % (
+                    self.name, self.count, self.run_time, self.run_max,
+                    self.late_max, ",".join(map(str, self.run_hist)),
+                    ",".join(map(str, self.late_hist))))
 
 class ReactorCompletion:
     class sentinel: pass
@@ -40,8 +96,8 @@ class ReactorCompletion:
 class ReactorCallback:
     def __init__(self, reactor, callback, waketime):
         self.reactor = reactor
-        self.timer = reactor.register_timer(self.invoke, waketime)
         self.callback = callback
+        self.timer = reactor.register_timer(self.invoke, waketime)
         self.completion = ReactorCompletion(reactor)
     def invoke(self, eventtime):
         self.reactor.unregister_timer(self.timer)
@@ -61,6 +117,7 @@ class ReactorGreenlet(greenlet.greenlet):
     def __init__(self, run):
         greenlet.greenlet.__init__(self, run=run)
         self.timer = None
+        self.timer_stats = None
 
 class ReactorMutex:
     def __init__(self, reactor, is_locked):
@@ -101,8 +158,12 @@ class SelectReactor:
         # Python garbage collection
         self._check_gc = gc_checking
         self._last_gc_times = [0., 0., 0.]
-        # Timers
-        self._timers = []
+        # Timers (a heap of (waketime, heap_seq, timer) entries - entries
+        # that no longer match the timer's heap_seq are ignored)
+        self._timer_heap = []
+        self._timer_seq = 0
+        self._timer_count = 0
+        self._timer_stats = {}
         self._next_timer = self.NEVER
         # Callbacks
         self._pipe_fds = None
@@ -116,22 +177,87 @@ class SelectReactor:
         self._all_greenlets = []
     def get_gc_stats(self):
         return tuple(self._last_gc_times)
+    def stats(self, eventtime):
+        recent = [(ts.get_recent(eventtime), ts.name)
+                  for ts in self._timer_stats.values()]
+        run_max = max([r[1] for r, n in recent] + [0.])
+        late_max = max([r[2] for r, n in recent] + [0.])
+        msg = ["reactor: timers=%d timer_late_max=%.6f timer_run_max=%.6f" % (
+            self._timer_count, late_max, run_max)]
+        # Report the callbacks with the longest run time or lateness
+        recent.sort(key=lambda e: max(e[0][1], e[0][2]), reverse=True)
+        for (calls, rmax, lmax), name in recent[:TIMER_STATS_TOP]:
+            if max(rmax, lmax) >= TIMER_HIST[0]:
+                msg.append("reactor_%s: calls=%d run_max=%.6f late_max=%.6f"
+                           % (name, calls, rmax, lmax))
+        return (False, " ".join(msg))
+    def get_running_timer(self):
+        # Return the name of the timer callback being run (if any).  This
+        # may be called from other threads.
+        g = self._g_dispatch
+        if g is None or g.timer_stats is None:
+            return None
+        return g.timer_stats.name
+    def get_timer_stats(self):
+        return ["Reactor timer %s" % (ts.get_info(),)
+                for n, ts in sorted(self._timer_stats.items())
+                if ts.count]
     # Timers
+    def _get_timer_stats(self, callback):
+        obj = getattr(callback, '__self__', None)
+        if isinstance(obj, ReactorCallback):
+            return self._get_timer_stats(obj.callback)
+        name = getattr(callback, '__name__', '?')
+        if obj is not None:
+            name = "%s.%s" % (type(obj).__name__, name)
+        else:
+            name = "%s.%s" % (getattr(callback, '__module__', '?'), name)
+        ts = self._timer_stats.get(name)
+        if ts is None:
+            ts = self._timer_stats[name] = ReactorTimerStats(name)
+        return ts
+    def _push_timer(self, timer_handler):
+        waketime = timer_handler.waketime
+        if waketime >= self.NEVER:
+            timer_handler.heap_seq = 0
+            return
+        heap = self._timer_heap
+        if len(heap) > 2 * self._timer_count + 32:
+            # Discard stale entries
+            heap[:] = [e for e in heap if e[1] == e[2].heap_seq]
+            heapq.heapify(heap)
+        self._timer_seq += 1
+        timer_handler.heap_seq = self._timer_seq
+        heapq.heappush(heap, (waketime, self._timer_seq, timer_handler))
     def update_timer(self, timer_handler, waketime):
-        timer_handler.waketime = waketime
+        if waketime != timer_handler.waketime or not timer_handler.heap_seq:
+            timer_handler.waketime = waketime
+            if timer_handler.is_registered:
+                self._push_timer(timer_handler)
         self._next_timer = min(self._next_timer, waketime)
     def register_timer(self, callback, waketime=NEVER):
-        timer_handler = ReactorTimer(callback, waketime)
-        timers = list(self._timers)
-        timers.append(timer_handler)
-        self._timers = timers
+        timer_handler = ReactorTimer(callback, waketime,
+                                     self._get_timer_stats(callback))
+        self._timer_count += 1
+        self._push_timer(timer_handler)
         self._next_timer = min(self._next_timer, waketime)
         return timer_handler
     def unregister_timer(self, timer_handler):
+        if not timer_handler.is_registered:
+            return
         timer_handler.waketime = self.NEVER
-        timers = list(self._timers)
-        timers.pop(timers.index(timer_handler))
-        self._timers = timers
+        timer_handler.is_registered = False
+        timer_handler.heap_seq = 0
+        self._timer_count -= 1
+    def _finish_timer(self, timer_handler, waketime):
+        timer_handler.waketime = waketime
+        if timer_handler.is_registered:
+            self._push_timer(timer_handler)
+    def _restore_timers(self, deferred):
+        heap = self._timer_heap
+        for entry in deferred:
+            if entry[1] == entry[2].heap_seq:
+                heapq.heappush(heap, entry)
     def _check_timers(self, eventtime, busy):
         if eventtime < self._next_timer:
             if busy:
@@ -149,18 +275,46 @@ class SelectReactor:
                     gc.collect(gc_level)
                     return 0.
             return min(1., max(.001, self._next_timer - eventtime))
-        self._next_timer = self.NEVER
+        # Run due timers in waketime order.  Entries added during this
+        # pass are set aside until the pass completes (so that each timer
+        # runs at most once per pass and can not starve the fd handlers).
+        heap = self._timer_heap
+        last_seq = self._timer_seq
+        deferred = []
         g_dispatch = self._g_dispatch
-        for t in self._timers:
-            waketime = t.waketime
-            if eventtime >= waketime:
-                t.waketime = self.NEVER
-                t.waketime = waketime = t.callback(eventtime)
-                if g_dispatch is not self._g_dispatch:
-                    self._next_timer = min(self._next_timer, waketime)
-                    self._end_greenlet(g_dispatch)
-                    return 0.
-            self._next_timer = min(self._next_timer, waketime)
+        start = eventtime
+        while heap:
+            waketime, seq, t = heap[0]
+            if seq != t.heap_seq:
+                heapq.heappop(heap)
+                continue
+            if waketime > eventtime:
+                break
+            if seq > last_seq:
+                deferred.append(heapq.heappop(heap))
+                continue
+            heapq.heappop(heap)
+            t.heap_seq = 0
+            t.waketime = self.NEVER
+            ts = g_dispatch.timer_stats = t.timer_stats
+            late = 0.
+            if waketime > self.NOW:
+                late = max(0., start - waketime)
+            waketime = t.callback(eventtime)
+            g_dispatch.timer_stats = None
+            if g_dispatch is not self._g_dispatch:
+                # Callback paused - its run time can not be determined
+                self._finish_timer(t, waketime)
+                self._restore_timers(deferred)
+                self._next_timer = min(self._next_timer, waketime)
+                self._end_greenlet(g_dispatch)
+                return 0.
+            end = self.monotonic()
+            ts.note(late, end - start, end)
+            start = end
+            self._finish_timer(t, waketime)
+        self._restore_timers(deferred)
+        self._next_timer = heap[0][0] if heap else self.NEVER
         return 0.
     # Callbacks and Completions
     def completion(self):
@@ -220,6 +374,9 @@ class SelectReactor:
             self._all_greenlets.append(g_next)
         g_next.parent = g.parent
         g.timer = self.register_timer(g.switch, waketime)
+        if g.timer_stats is not None:
+            # Account the time after the pause to the original timer
+            g.timer.timer_stats = g.timer_stats
         self._next_timer = self.NOW
         # Switch to _dispatch_loop (via _end_greenlet or direct)
         eventtime = g_next.switch()
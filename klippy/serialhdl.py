@@ -21,6 +21,7 @@ class SerialReader:
         # C interface
         self.ffi_main, self.ffi_lib = chelper.get_ffi()
         self.serialqueue = None
+        self.io_engine = self.ffi_main.NULL
         self.default_cmd_queue = self.alloc_command_queue()
         self.stats_buf = self.ffi_main.new('char[4096]')
         # Threading
@@ -79,8 +80,9 @@ class SerialReader:
     def _start_session(self, serial_dev, serial_fd_type=b'u', client_id=0):
         self.serial_dev = serial_dev
         self.serialqueue = self.ffi_main.gc(
-            self.ffi_lib.serialqueue_alloc(serial_dev.fileno(),
-                                           serial_fd_type, client_id),
+            self.ffi_lib.serialqueue_alloc_shared(serial_dev.fileno(),
+                                                  serial_fd_type, client_id,
+                                                  self.io_engine),
             self.ffi_lib.serialqueue_free)
         self.background_thread = threading.Thread(target=self._bg_thread)
         self.background_thread.start()
@@ -222,6 +224,9 @@ class SerialReader:
         self.ffi_lib.serialqueue_get_stats(self.serialqueue,
                                            self.stats_buf, len(self.stats_buf))
         return str(self.ffi_main.string(self.stats_buf).decode())
+    def set_io_engine(self, io_engine):
+        # Use a shared background thread (see extras/io_thread.py)
+        self.io_engine = io_engine
     def get_reactor(self):
         return self.reactor
     def get_msgparser(self):
@@ -3,8 +3,8 @@
 # Copyright (C) 2016-2021  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import math, logging, importlib
-import mcu, chelper, kinematics.extruder
+import math, logging, importlib, multiprocessing
+import mcu, chelper, stepper, kinematics.extruder
 
 # Common suffixes: _d is distance (in mm), _v is velocity (in
 #   mm/second), _v2 is velocity squared (mm^2/s^2), _t is time (in
@@ -18,6 +18,7 @@ class Move:
         self.end_pos = tuple(end_pos)
         self.accel = toolhead.max_accel
         self.timing_callbacks = []
+        self.trace_id = 0
         velocity = min(speed, toolhead.max_velocity)
         self.is_kinematic_move = True
         self.axes_d = axes_d = [end_pos[i] - start_pos[i] for i in (0, 1, 2, 3)]
@@ -41,10 +42,8 @@ class Move:
         # Junction speeds are tracked in velocity squared.  The
         # delta_v2 is the maximum amount of this squared-velocity that
         # can change in this move.
-        self.max_start_v2 = 0.
         self.max_cruise_v2 = velocity**2
         self.delta_v2 = 2.0 * move_d * self.accel
-        self.max_smoothed_v2 = 0.
         self.smooth_delta_v2 = 2.0 * move_d * toolhead.max_accel_to_decel
     def limit_speed(self, speed, accel):
         speed2 = speed**2
@@ -58,130 +57,92 @@ class Move:
         ep = self.end_pos
         m = "%s: %.3f %.3f %.3f [%.3f]" % (msg, ep[0], ep[1], ep[2], ep[3])
         return self.toolhead.printer.command_error(m)
-    def calc_junction(self, prev_move):
-        if not self.is_kinematic_move or not prev_move.is_kinematic_move:
-            return
-        # Allow extruder to calculate its maximum junction
-        extruder_v2 = self.toolhead.extruder.calc_junction(prev_move, self)
-        # Find max velocity using "approximated centripetal velocity"
-        axes_r = self.axes_r
-        prev_axes_r = prev_move.axes_r
-        junction_cos_theta = -(axes_r[0] * prev_axes_r[0]
-                               + axes_r[1] * prev_axes_r[1]
-                               + axes_r[2] * prev_axes_r[2])
-        if junction_cos_theta > 0.999999:
-            return
-        junction_cos_theta = max(junction_cos_theta, -0.999999)
-        sin_theta_d2 = math.sqrt(0.5*(1.0-junction_cos_theta))
-        R = (self.toolhead.junction_deviation * sin_theta_d2
-             / (1. - sin_theta_d2))
-        # Approximated circle must contact moves no further away than mid-move
-        tan_theta_d2 = sin_theta_d2 / math.sqrt(0.5*(1.0+junction_cos_theta))
-        move_centripetal_v2 = .5 * self.move_d * tan_theta_d2 * self.accel
-        prev_move_centripetal_v2 = (.5 * prev_move.move_d * tan_theta_d2
-                                    * prev_move.accel)
-        # Apply limits
-        self.max_start_v2 = min(
-            R * self.accel, R * prev_move.accel,
-            move_centripetal_v2, prev_move_centripetal_v2,
-            extruder_v2, self.max_cruise_v2, prev_move.max_cruise_v2,
-            prev_move.max_start_v2 + prev_move.delta_v2)
-        self.max_smoothed_v2 = min(
-            self.max_start_v2
-            , prev_move.max_smoothed_v2 + prev_move.smooth_delta_v2)
-    def set_junction(self, start_v2, cruise_v2, end_v2):
-        # Determine accel, cruise, and decel portions of the move distance
-        half_inv_accel = .5 / self.accel
-        accel_d = (cruise_v2 - start_v2) * half_inv_accel
-        decel_d = (cruise_v2 - end_v2) * half_inv_accel
-        cruise_d = self.move_d - accel_d - decel_d
-        # Determine move velocities
-        self.start_v = start_v = math.sqrt(start_v2)
-        self.cruise_v = cruise_v = math.sqrt(cruise_v2)
-        self.end_v = end_v = math.sqrt(end_v2)
-        # Determine time spent in each portion of move (time is the
-        # distance divided by average velocity)
-        self.accel_t = accel_d / ((start_v + cruise_v) * 0.5)
-        self.cruise_t = cruise_d / cruise_v
-        self.decel_t = decel_d / ((end_v + cruise_v) * 0.5)
 
-LOOKAHEAD_FLUSH_TIME = 0.250
+# Lookahead move flags (see klippy/chelper/lookahead.h)
+LM_KINEMATIC = 1<<0
+LM_EXTRUDE = 1<<1
+LM_PRESSURE_ADVANCE = 1<<2
+
+# Motion trace stages (see klippy/chelper/trace.h)
+TRACE_MOVE_ADD = 1
+TRACE_MOVE_PLAN = 2
 
 # Class to track a list of pending move requests and to facilitate
 # "look-ahead" across moves to reduce acceleration between moves.
+# The junction speed calculations are implemented in C (see
+# klippy/chelper/lookahead.c).
 class MoveQueue:
     def __init__(self, toolhead):
         self.toolhead = toolhead
         self.queue = []
-        self.junction_flush = LOOKAHEAD_FLUSH_TIME
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.lookahead = ffi_main.gc(ffi_lib.lookahead_alloc(),
+                                     ffi_lib.lookahead_free)
+        self.lookahead_add_move = ffi_lib.lookahead_add_move
+        self.lookahead_flush = ffi_lib.lookahead_flush
+        self.lookahead_queue_moves = ffi_lib.lookahead_queue_moves
+        self.trace_event = None
+        self.trace_count = 0
     def reset(self):
         del self.queue[:]
-        self.junction_flush = LOOKAHEAD_FLUSH_TIME
+        ffi_main, ffi_lib = chelper.get_ffi()
+        ffi_lib.lookahead_reset(self.lookahead)
     def set_flush_time(self, flush_time):
-        self.junction_flush = flush_time
+        ffi_main, ffi_lib = chelper.get_ffi()
+        ffi_lib.lookahead_set_flush_time(self.lookahead, flush_time)
+    def set_junction_deviation(self, junction_deviation):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        ffi_lib.lookahead_set_junction_deviation(self.lookahead,
+                                                 junction_deviation)
     def get_last(self):
         if self.queue:
             return self.queue[-1]
         return None
     def flush(self, lazy=False):
-        self.junction_flush = LOOKAHEAD_FLUSH_TIME
-        update_flush_count = lazy
         queue = self.queue
-        flush_count = len(queue)
-        # Traverse queue from last to first move and determine maximum
-        # junction speed assuming the robot comes to a complete stop
-        # after the last move.
-        delayed = []
-        next_end_v2 = next_smoothed_v2 = peak_cruise_v2 = 0.
-        for i in range(flush_count-1, -1, -1):
-            move = queue[i]
-            reachable_start_v2 = next_end_v2 + move.delta_v2
-            start_v2 = min(move.max_start_v2, reachable_start_v2)
-            reachable_smoothed_v2 = next_smoothed_v2 + move.smooth_delta_v2
-            smoothed_v2 = min(move.max_smoothed_v2, reachable_smoothed_v2)
-            if smoothed_v2 < reachable_smoothed_v2:
-                # It's possible for this move to accelerate
-                if (smoothed_v2 + move.smooth_delta_v2 > next_smoothed_v2
-                    or delayed):
-                    # This move can decelerate or this is a full accel
-                    # move after a full decel move
-                    if update_flush_count and peak_cruise_v2:
-                        flush_count = i
-                        update_flush_count = False
-                    peak_cruise_v2 = min(move.max_cruise_v2, (
-                        smoothed_v2 + reachable_smoothed_v2) * .5)
-                    if delayed:
-                        # Propagate peak_cruise_v2 to any delayed moves
-                        if not update_flush_count and i < flush_count:
-                            mc_v2 = peak_cruise_v2
-                            for m, ms_v2, me_v2 in reversed(delayed):
-                                mc_v2 = min(mc_v2, ms_v2)
-                                m.set_junction(min(ms_v2, mc_v2), mc_v2
-                                               , min(me_v2, mc_v2))
-                        del delayed[:]
-                if not update_flush_count and i < flush_count:
-                    cruise_v2 = min((start_v2 + reachable_start_v2) * .5
-                                    , move.max_cruise_v2, peak_cruise_v2)
-                    move.set_junction(min(start_v2, cruise_v2), cruise_v2
-                                      , min(next_end_v2, cruise_v2))
-            else:
-                # Delay calculating this move until peak_cruise_v2 is known
-                delayed.append((move, start_v2, next_end_v2))
-            next_end_v2 = start_v2
-            next_smoothed_v2 = smoothed_v2
-        if update_flush_count or not flush_count:
+        flush_count = self.lookahead_flush(self.lookahead, lazy)
+        if not flush_count:
             return
         # Generate step times for all moves ready to be flushed
         self.toolhead._process_moves(queue[:flush_count])
         # Remove processed moves from the queue
         del queue[:flush_count]
+    def queue_moves(self, moves, print_time, trapq, extruder_trapq):
+        # Add moves (from the start of the queue) to the trapq
+        ffi_main, ffi_lib = chelper.get_ffi()
+        count = len(moves)
+        end_times = ffi_main.new("double[]", count)
+        self.lookahead_queue_moves(self.lookahead, count, print_time,
+                                   trapq, extruder_trapq, end_times)
+        return end_times
     def add_move(self, move):
-        self.queue.append(move)
-        if len(self.queue) == 1:
-            return
-        move.calc_junction(self.queue[-2])
-        self.junction_flush -= move.min_move_t
-        if self.junction_flush <= 0.:
+        queue = self.queue
+        queue.append(move)
+        if self.trace_event is not None:
+            self.trace_count += 1
+            move.trace_id = self.trace_count
+            self.trace_event(TRACE_MOVE_ADD, move.trace_id, move.move_d, 0.)
+        flags = 0
+        extruder_v2 = move.max_cruise_v2
+        if move.is_kinematic_move:
+            flags |= LM_KINEMATIC
+            if len(queue) > 1 and queue[-2].is_kinematic_move:
+                # Allow extruder to calculate its maximum junction
+                extruder = self.toolhead.extruder
+                extruder_v2 = extruder.calc_junction(queue[-2], move)
+        axes_d = move.axes_d
+        axes_r = move.axes_r
+        if axes_d[3]:
+            flags |= LM_EXTRUDE
+            if axes_r[3] > 0. and (axes_d[0] or axes_d[1]):
+                flags |= LM_PRESSURE_ADVANCE
+        start_pos = move.start_pos
+        if self.lookahead_add_move(
+                self.lookahead, move.move_d, move.min_move_t,
+                start_pos[0], start_pos[1], start_pos[2], start_pos[3],
+                axes_r[0], axes_r[1], axes_r[2], axes_r[3],
+                move.accel, move.max_cruise_v2, move.delta_v2,
+                move.smooth_delta_v2, extruder_v2, flags):
             # Enough moves have been queued to reach the target flush time.
             self.flush(lazy=True)
 
@@ -243,13 +204,27 @@ class ToolHead:
         # Setup iterative solver
         ffi_main, ffi_lib = chelper.get_ffi()
         self.trapq = ffi_main.gc(ffi_lib.trapq_alloc(), ffi_lib.trapq_free)
-        self.trapq_append = ffi_lib.trapq_append
         self.trapq_finalize_moves = ffi_lib.trapq_finalize_moves
+        self.stats_buf = ffi_main.new('char[256]')
         self.step_generators = []
+        # Setup parallel step generation
+        try:
+            cpu_count = multiprocessing.cpu_count()
+        except NotImplementedError:
+            cpu_count = 1
+        step_gen_threads = config.getint('step_generation_threads',
+                                         cpu_count, minval=0)
+        self.step_gen_steppers = []
+        self.step_gen_pool = ffi_main.gc(
+            ffi_lib.itersolve_pool_alloc(step_gen_threads - 1),
+            ffi_lib.itersolve_pool_free)
+        self.itersolve_pool_generate_steps = (
+            ffi_lib.itersolve_pool_generate_steps)
         # Create kinematics class
         gcode = self.printer.lookup_object('gcode')
         self.Coord = gcode.Coord
         self.extruder = kinematics.extruder.DummyExtruder(self.printer)
+        self.extruder_trapq = ffi_main.NULL
         kin_name = config.get('kinematics')
         try:
             mod = importlib.import_module('kinematics.' + kin_name)
@@ -282,8 +257,7 @@ class ToolHead:
         while 1:
             self.print_time = min(self.print_time + batch_time, next_print_time)
             sg_flush_time = max(lkft, self.print_time - kin_flush_delay)
-            for sg in self.step_generators:
-                sg(sg_flush_time)
+            self._generate_steps(sg_flush_time)
             free_time = max(lkft, sg_flush_time - kin_flush_delay)
             self.trapq_finalize_moves(self.trapq, free_time)
             self.extruder.update_move_time(free_time)
@@ -292,6 +266,18 @@ class ToolHead:
                 m.flush_moves(mcu_flush_time)
             if self.print_time >= next_print_time:
                 break
+    def _generate_steps(self, flush_time):
+        for sg in self.step_generators:
+            sg(flush_time)
+        # Generate steps for all registered steppers in one call
+        steppers = self.step_gen_steppers
+        for s in steppers:
+            s.check_active_callbacks(flush_time)
+        sks = [s.get_stepper_kinematics() for s in steppers]
+        ret = self.itersolve_pool_generate_steps(self.step_gen_pool, sks,
+                                                 len(sks), flush_time)
+        if ret:
+            raise stepper.error("Internal error in stepcompress")
     def _calc_print_time(self):
         curtime = self.reactor.monotonic()
         est_print_time = self.mcu.estimated_print_time(curtime)
@@ -312,21 +298,22 @@ class ToolHead:
                 self.reactor.update_timer(self.flush_timer, self.reactor.NOW)
             self._calc_print_time()
         # Queue moves into trapezoid motion queue (trapq)
+        end_times = self.move_queue.queue_moves(
+            moves, self.print_time, self.trapq, self.extruder_trapq)
         next_move_time = self.print_time
-        for move in moves:
-            if move.is_kinematic_move:
-                self.trapq_append(
-                    self.trapq, next_move_time,
-                    move.accel_t, move.cruise_t, move.decel_t,
-                    move.start_pos[0], move.start_pos[1], move.start_pos[2],
-                    move.axes_r[0], move.axes_r[1], move.axes_r[2],
-                    move.start_v, move.cruise_v, move.accel)
+        extrude_pos = None
+        trace_event = self.move_queue.trace_event
+        for i, move in enumerate(moves):
+            if trace_event is not None and move.trace_id:
+                trace_event(TRACE_MOVE_PLAN, move.trace_id,
+                            next_move_time, end_times[i])
+            next_move_time = end_times[i]
             if move.axes_d[3]:
-                self.extruder.move(next_move_time, move)
-            next_move_time = (next_move_time + move.accel_t
-                              + move.cruise_t + move.decel_t)
+                extrude_pos = move.end_pos[3]
             for cb in move.timing_callbacks:
                 cb(next_move_time)
+        if extrude_pos is not None:
+            self.extruder.last_position = extrude_pos
         # Generate steps for moves
         if self.special_queuing_state:
             self._update_drip_move_time(next_move_time)
@@ -440,6 +427,7 @@ class ToolHead:
             eventtime = self.reactor.pause(eventtime + 0.100)
     def set_extruder(self, extruder, extrude_pos):
         self.extruder = extruder
+        self.extruder_trapq = extruder.get_trapq()
         self.commanded_pos[3] = extrude_pos
     def get_extruder(self):
         return self.extruder
@@ -490,8 +478,14 @@ class ToolHead:
         is_active = buffer_time > -60. or not self.special_queuing_state
         if self.special_queuing_state == "Drip":
             buffer_time = 0.
-        return is_active, "print_time=%.3f buffer_time=%.3f print_stall=%d" % (
-            self.print_time, max(buffer_time, 0.), self.print_stall)
+        ffi_main, ffi_lib = chelper.get_ffi()
+        ffi_lib.trapq_get_stats(self.trapq, self.stats_buf,
+                                len(self.stats_buf))
+        trapq_stats = str(ffi_main.string(self.stats_buf).decode())
+        return is_active, (
+            "print_time=%.3f buffer_time=%.3f print_stall=%d %s" % (
+                self.print_time, max(buffer_time, 0.), self.print_stall,
+                trapq_stats))
     def check_busy(self, eventtime):
         est_print_time = self.mcu.estimated_print_time(eventtime)
         lookahead_empty = not self.move_queue.queue
@@ -517,8 +511,13 @@ class ToolHead:
         return self.kin
     def get_trapq(self):
         return self.trapq
+    def set_trace_callback(self, trace_event):
+        self.move_queue.trace_event = trace_event
     def register_step_generator(self, handler):
         self.step_generators.append(handler)
+    def register_step_generator_stepper(self, stepper):
+        # Steps for registered steppers may be generated in parallel
+        self.step_gen_steppers.append(stepper)
     def note_step_generation_scan_time(self, delay, old_delay=0.):
         self.flush_step_generation()
         cur_delay = self.kin_flush_delay
@@ -541,6 +540,7 @@ class ToolHead:
     def _calc_junction_deviation(self):
         scv2 = self.square_corner_velocity**2
         self.junction_deviation = scv2 * (math.sqrt(2.) - 1.) / self.max_accel
+        self.move_queue.set_junction_deviation(self.junction_deviation)
         self.max_accel_to_decel = min(self.requested_accel_to_decel,
                                       self.max_accel)
     def cmd_G4(self, gcmd):
@@ -461,9 +461,24 @@ class QueryStatusHelper:
         objects = [n for n, o in self.printer.lookup_objects()
                    if hasattr(o, 'get_status')]
         web_request.send({'objects': objects})
+    def _get_changes(self, res, lres):
+        # Status values are replaced (not modified) when they change, so
+        # an unchanged value is usually the same object as last time
+        if res is lres:
+            return {}
+        changes = {}
+        for ri, rd in res.items():
+            ld = lres.get(ri)
+            if rd is not ld and rd != ld:
+                changes[ri] = rd
+        for ri, ld in lres.items():
+            if ld is not None and ri not in res:
+                changes[ri] = None
+        return changes
     def _do_query(self, eventtime):
         last_query = self.last_query
         query = self.last_query = {}
+        changes = {}
         msglist = self.pending_queries
         self.pending_queries = []
         msglist.extend(self.clients.values())
@@ -487,13 +502,20 @@ class QueryStatusHelper:
                     req_items = list(res.keys())
                     if req_items:
                         subscription[obj_name] = req_items
-                lres = last_query.get(obj_name, {})
-                cres = {}
-                for ri in req_items:
-                    rd = res.get(ri, None)
-                    if is_query or rd != lres.get(ri):
-                        cres[ri] = rd
-                if cres or is_query:
+                if is_query:
+                    cquery[obj_name] = {ri: res.get(ri, None)
+                                        for ri in req_items}
+                    continue
+                # Determine what changed (once for all subscribed clients)
+                ochanges = changes.get(obj_name)
+                if ochanges is None:
+                    ochanges = changes[obj_name] = self._get_changes(
+                        res, last_query.get(obj_name, {}))
+                if not ochanges:
+                    continue
+                cres = {ri: ochanges[ri] for ri in req_items
+                        if ri in ochanges}
+                if cres:
                     cquery[obj_name] = cres
             # Send data
             if cquery or is_query:
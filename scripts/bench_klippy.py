@@ -0,0 +1,265 @@
+#!/usr/bin/env python3
+# Benchmark the host motion pipeline using the klippy batch mode
+#
+# Copyright (C) 2026  The Klipper developers
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, optparse, time, math, json, platform
+sys.path.append(os.path.join(os.path.dirname(os.path.realpath(__file__)),
+                             '..', 'klippy'))
+import msgproto, util
+
+BENCH_FORMAT_VERSION = 1
+TEMP_CONFIG_FILE = "_bench_.cfg"
+TEMP_GCODE_FILE = "_bench_.gcode"
+TEMP_LOG_FILE = "_bench_.log"
+TEMP_OUTPUT_FILE = "_bench_output"
+
+
+######################################################################
+# G-Code corpora
+######################################################################
+
+# Extrusion amount per mm of movement (0.4mm by 0.2mm lines of 1.75mm
+# filament)
+EXTRUDE_RATIO = .4 * .2 / (math.pi * (1.75 / 2.)**2)
+RADIUS = 40.
+
+def gcode_start(center):
+    return ["G28", "G90", "M83", "G1 X%.3f Y%.3f Z1 F6000" % center]
+
+# Many short segments tracing a spiral (similar to finely tessellated
+# curves from a slicer)
+def gcode_tiny(center, count=50000, seg_len=.2):
+    out = gcode_start(center)
+    angle = 0.
+    for i in range(count):
+        r = RADIUS * (.25 + .75 * i / count)
+        angle += seg_len / r
+        out.append("G1 X%.3f Y%.3f E%.5f F6000" % (
+            center[0] + r * math.cos(angle), center[1] + r * math.sin(angle),
+            seg_len * EXTRUDE_RATIO))
+    return out
+
+# Full circles of varying radius using G2/G3 (see [gcode_arcs])
+def gcode_arcs(center, count=600):
+    out = gcode_start(center)
+    for i in range(count):
+        r = RADIUS * (.1 + .9 * (i % 30) / 30.)
+        length = 2. * math.pi * r
+        out.append("G1 X%.3f Y%.3f F6000" % (center[0] + r, center[1]))
+        out.append("%s X%.3f Y%.3f I%.3f J0 E%.5f F6000" % (
+            "G2" if i & 1 else "G3", center[0] + r, center[1], -r,
+            length * EXTRUDE_RATIO))
+    return out
+
+# name: (gcode generator, extra config)
+CORPORA = {
+    "tiny": (gcode_tiny, ""),
+    "arcs": (gcode_arcs, ""),
+    "shaped": (gcode_tiny, """
+[input_shaper]
+shaper_type: mzv
+shaper_freq_x: 50
+shaper_freq_y: 50
+"""),
+    "pa": (gcode_tiny, """
+[extruder]
+pressure_advance: 0.05
+"""),
+}
+
+# name: (example config, center of the moves)
+KINEMATICS = {
+    "cartesian": ("example-cartesian.cfg", (100., 100.)),
+    "corexy": ("example-corexy.cfg", (100., 100.)),
+    "corexz": ("example-corexz.cfg", (100., 100.)),
+    "hybrid_corexy": ("example-hybrid-corexy.cfg", (100., 100.)),
+    "delta": ("example-delta.cfg", (0., 0.)),
+    "rotary_delta": ("example-rotary-delta.cfg", (0., 0.)),
+    "polar": ("example-polar.cfg", (100., 0.)),
+}
+
+BASE_CONFIG = """
+[include %s]
+
+[extruder]
+min_extrude_temp: 0
+
+[gcode_arcs]
+"""
+
+
+######################################################################
+# Output analysis
+######################################################################
+
+# Return the number of steps and the total size of the queue_step
+# commands in a batch mode output file
+def analyze_output(dict_fname, output_fname):
+    f = open(dict_fname, 'rb')
+    dictionary = f.read()
+    f.close()
+    mp = msgproto.MessageParser()
+    mp.process_identify(dictionary, decompress=False)
+    queue_step = mp.messages_by_name['queue_step']
+    f = open(output_fname, 'rb')
+    data = bytearray(f.read())
+    f.close()
+    steps = step_bytes = 0
+    pos = 0
+    while pos + msgproto.MESSAGE_MIN <= len(data):
+        msglen = data[pos]
+        end = pos + msglen - msgproto.MESSAGE_TRAILER_SIZE
+        mpos = pos + msgproto.MESSAGE_HEADER_SIZE
+        while mpos < end:
+            mid = mp.messages_by_id.get(data[mpos], mp.unknown)
+            params, npos = mid.parse(data, mpos)
+            if mid is queue_step:
+                steps += params['count']
+                step_bytes += npos - mpos
+            mpos = npos
+        pos += msglen
+    return steps, step_bytes
+
+
+######################################################################
+# Benchmark runs
+######################################################################
+
+class error(Exception):
+    pass
+
+class Benchmark:
+    def __init__(self, kin_name, corpus_name, options):
+        self.kin_name, self.corpus_name = kin_name, corpus_name
+        self.name = "%s-%s" % (kin_name, corpus_name)
+        self.options = options
+    def relpath(self, fname):
+        return os.path.join(self.options.tempdir, fname)
+    def write_files(self):
+        config_fname, center = KINEMATICS[self.kin_name]
+        gen_gcode, extra_config = CORPORA[self.corpus_name]
+        config_dir = os.path.join(os.path.dirname(os.path.realpath(__file__)),
+                                  '..', 'config')
+        f = open(self.relpath(TEMP_CONFIG_FILE), 'w')
+        f.write(BASE_CONFIG % (os.path.join(config_dir, config_fname),)
+                + extra_config)
+        f.close()
+        gcode = gen_gcode(center)
+        f = open(self.relpath(TEMP_GCODE_FILE), 'w')
+        f.write('\n'.join(gcode + ['']))
+        f.close()
+        return len([l for l in gcode if l.split()[0] in ("G1", "G2", "G3")])
+    def run_once(self):
+        args = [sys.executable, os.path.join(
+                    os.path.dirname(os.path.realpath(__file__)),
+                    '..', 'klippy', 'klippy.py'),
+                self.relpath(TEMP_CONFIG_FILE),
+                '-i', self.relpath(TEMP_GCODE_FILE),
+                '-o', self.relpath(TEMP_OUTPUT_FILE),
+                '-l', self.relpath(TEMP_LOG_FILE),
+                '-d', self.options.dictionary]
+        start_time = time.time()
+        pid = os.spawnv(os.P_NOWAIT, sys.executable, args)
+        pid, status, rusage = os.wait4(pid, 0)
+        elapsed = time.time() - start_time
+        if status:
+            f = open(self.relpath(TEMP_LOG_FILE), 'r')
+            sys.stdout.write(f.read())
+            f.close()
+            raise error("klippy failed on %s" % (self.name,))
+        # ru_maxrss is reported in kilobytes on Linux
+        return (elapsed, rusage.ru_utime + rusage.ru_stime,
+                rusage.ru_maxrss * 1024)
+    def run(self):
+        moves = self.write_files()
+        runs = [self.run_once() for i in range(self.options.repeat)]
+        # Report the fastest run (the others include outside noise)
+        elapsed, cpu_time, peak_rss = min(runs)
+        steps, step_bytes = analyze_output(self.options.dictionary,
+                                           self.relpath(TEMP_OUTPUT_FILE))
+        for fname in [TEMP_CONFIG_FILE, TEMP_GCODE_FILE, TEMP_LOG_FILE,
+                      TEMP_OUTPUT_FILE]:
+            os.unlink(self.relpath(fname))
+        return {
+            'name': self.name, 'kinematics': self.kin_name,
+            'corpus': self.corpus_name, 'moves': moves, 'steps': steps,
+            'queue_step_bytes': step_bytes, 'elapsed': round(elapsed, 4),
+            'cpu_time': round(cpu_time, 4),
+            'moves_per_sec': round(moves / elapsed, 1),
+            'steps_per_sec': round(steps / elapsed, 1),
+            'queue_step_bytes_per_sec': round(step_bytes / elapsed, 1),
+            'peak_rss': peak_rss }
+
+
+######################################################################
+# Startup
+######################################################################
+
+def main():
+    # Parse args
+    usage = "%prog [options] <dictionary file>"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-k", "--kinematics", dest="kinematics",
+                    default=",".join(sorted(KINEMATICS)),
+                    help="comma separated list of kinematics to run")
+    opts.add_option("-c", "--corpus", dest="corpus",
+                    default=",".join(sorted(CORPORA)),
+                    help="comma separated list of g-code corpora to run")
+    opts.add_option("-r", "--repeat", type="int", dest="repeat", default=1,
+                    help="number of times to run each benchmark")
+    opts.add_option("-o", "--output", dest="output", default=None,
+                    help="write the results to a json file")
+    opts.add_option("-t", "--tempdir", dest="tempdir", default=".",
+                    help="directory for temporary files")
+    options, args = opts.parse_args()
+    if len(args) != 1:
+        opts.error("Incorrect number of arguments")
+    options.dictionary = args[0]
+    kin_names = options.kinematics.split(',')
+    corpus_names = options.corpus.split(',')
+    for name in kin_names:
+        if name not in KINEMATICS:
+            opts.error("Unknown kinematics '%s'" % (name,))
+    for name in corpus_names:
+        if name not in CORPORA:
+            opts.error("Unknown corpus '%s'" % (name,))
+    if options.repeat < 1:
+        opts.error("Invalid repeat count")
+
+    # Run each benchmark
+    results = []
+    sys.stdout.write("%-24s %9s %11s %11s %9s %8s\n" % (
+        "benchmark", "moves/s", "steps/s", "qstep B/s", "elapsed", "rss MB"))
+    for kin_name in kin_names:
+        for corpus_name in corpus_names:
+            bench = Benchmark(kin_name, corpus_name, options)
+            try:
+                res = bench.run()
+            except error as e:
+                sys.stderr.write("\n\n%s\n\n" % (str(e),))
+                sys.exit(-1)
+            sys.stdout.write("%-24s %9.0f %11.0f %11.0f %9.3f %8.1f\n" % (
+                res['name'], res['moves_per_sec'], res['steps_per_sec'],
+                res['queue_step_bytes_per_sec'], res['elapsed'],
+                res['peak_rss'] / (1024. * 1024.)))
+            sys.stdout.flush()
+            results.append(res)
+
+    # Write results
+    if options.output is not None:
+        data = {
+            'format_version': BENCH_FORMAT_VERSION,
+            'git_version': util.get_git_version(),
+            'python': platform.python_version(),
+            'cpu': util.get_cpu_info(),
+            'repeat': options.repeat,
+            'benchmarks': sorted(results, key=lambda r: r['name']) }
+        f = open(options.output, 'w')
+        json.dump(data, f, indent=2, sort_keys=True)
+        f.write('\n')
+        f.close()
+
+if __name__ == '__main__':
+    main()
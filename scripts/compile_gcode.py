@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+# Compile a g-code file into a job file for the virtual_sdcard module
+#
+# Copyright (C) 2026  The Klipper developers
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import importlib, optparse, os, sys, re, json, struct
+sys.path.append(os.path.join(os.path.dirname(os.path.realpath(__file__)),
+                             '..', 'klippy'))
+import chelper
+virtual_sdcard = importlib.import_module('.virtual_sdcard', 'extras')
+
+BLOCK_SIZE = 1024 * 1024
+
+# Slicer layer change markers (only the first style found is used)
+layer_r = re.compile(br'^\s*(?:(;\s*LAYER_CHANGE)|(;\s*LAYER:)'
+                     br'|(SET_PRINT_STATS_INFO\s.*CURRENT_LAYER=))', re.I)
+object_r = re.compile(br'^\s*EXCLUDE_OBJECT_(START|END)\s.*NAME=("[^"]*"|\S+)',
+                      re.I)
+
+# Return the blocks of the file (each ending at a newline if possible)
+def read_blocks(f):
+    partial = b""
+    while 1:
+        data = f.read(BLOCK_SIZE)
+        if not data:
+            if partial:
+                yield partial
+            return
+        data = partial + data
+        eol = data.rfind(b'\n')
+        if eol < 0:
+            partial = data
+            continue
+        partial = data[eol+1:]
+        yield data[:eol+1]
+
+class JobCompiler:
+    def __init__(self, infile, outfile):
+        self.infile, self.outfile = infile, outfile
+        self.ffi_main, self.ffi_lib = chelper.get_ffi()
+        self.line_count = self.move_count = 0
+        self.layers = []
+        self.layer_style = None
+        self.objects = []
+        self.open_objects = {}
+    def scan_line(self, line, pos, next_pos):
+        if line.lstrip()[:1] not in (b';', b'S', b's', b'E', b'e'):
+            return
+        m = layer_r.match(line)
+        if m is not None:
+            style = m.lastindex
+            if self.layer_style is None:
+                self.layer_style = style
+            if style == self.layer_style:
+                self.layers.append(pos)
+            return
+        m = object_r.match(line)
+        if m is not None:
+            name = m.group(2).strip(b'"').decode('utf-8', 'replace').upper()
+            if m.group(1).upper() == b'START':
+                self.open_objects[name] = pos
+            elif name in self.open_objects:
+                start = self.open_objects.pop(name)
+                self.objects.append([name, start, next_pos])
+    def compile(self):
+        text_size = os.path.getsize(self.infile)
+        # Count lines so that the location of each section is known
+        with open(self.infile, 'rb') as f:
+            newlines = last = 0
+            for block in read_blocks(f):
+                newlines += block.count(b'\n')
+                last = block[-1:]
+        line_count = newlines + (text_size and last != b'\n')
+        text_offset = virtual_sdcard.JOB_HEADER.size
+        lines_offset = (text_offset + text_size + 7) & ~7
+        records_offset = lines_offset + line_count * 8
+        layers_offset = (records_offset
+                         + line_count * virtual_sdcard.JOB_RECORD.size)
+        # Copy the text and build the line index and move records
+        records = self.ffi_main.new('double[]', 0)
+        records_count = 0
+        pos = line_num = 0
+        with open(self.infile, 'rb') as f, open(self.outfile, 'wb') as out:
+            for block in read_blocks(f):
+                out.seek(text_offset + pos)
+                out.write(block)
+                lines = block.split(b'\n')
+                if block.endswith(b'\n'):
+                    lines.pop()
+                offsets = []
+                for line in lines:
+                    next_pos = pos + len(line) + 1
+                    offsets.append(pos)
+                    self.scan_line(line, pos, next_pos)
+                    pos = next_pos
+                count = len(lines)
+                if count > records_count:
+                    records_count = count
+                    records = self.ffi_main.new('double[]', 6 * count)
+                res = self.ffi_lib.gcode_parse_moves(block, len(block),
+                                                     records, count)
+                if block.endswith(b'\n'):
+                    # The final newline does not start another line
+                    res -= 1
+                if res != count:
+                    raise Exception("Unable to parse moves")
+                moves = self.ffi_main.unpack(records, 6 * count)
+                self.move_count += len([c for c in moves[::6] if c >= 0.])
+                out.seek(lines_offset + line_num * 8)
+                out.write(struct.pack('<%dQ' % (count,), *offsets))
+                out.seek(records_offset
+                         + line_num * virtual_sdcard.JOB_RECORD.size)
+                out.write(struct.pack('<%dd' % (6 * count,), *moves))
+                line_num += count
+            if line_num != line_count:
+                raise Exception("Input file changed during compile")
+            self.line_count = line_count
+            # Write the layer and object indexes
+            out.seek(layers_offset)
+            out.write(struct.pack('<%dQ' % (len(self.layers),), *self.layers))
+            objects_offset = layers_offset + len(self.layers) * 8
+            objects = json.dumps(self.objects).encode()
+            out.write(objects)
+            out.seek(0)
+            out.write(virtual_sdcard.JOB_HEADER.pack(
+                virtual_sdcard.JOB_MAGIC, virtual_sdcard.JOB_VERSION, 0,
+                text_offset, text_size, line_count, lines_offset,
+                records_offset, len(self.layers), layers_offset,
+                objects_offset, len(objects)))
+
+def main():
+    usage = "%prog [options] <input.gcode> [<output.kjob>]"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-v", action="store_true", dest="verbose",
+                    help="list the layers and objects found")
+    options, args = opts.parse_args()
+    if len(args) not in (1, 2):
+        opts.error("Incorrect number of arguments")
+    infile = args[0]
+    if len(args) == 2:
+        outfile = args[1]
+    else:
+        outfile = os.path.splitext(infile)[0] + '.kjob'
+    jc = JobCompiler(infile, outfile)
+    jc.compile()
+    print("Compiled %d lines (%d moves, %d layers, %d objects) to %s"
+          % (jc.line_count, jc.move_count, len(jc.layers), len(jc.objects),
+             outfile))
+    if options.verbose:
+        for i, pos in enumerate(jc.layers):
+            print("layer %d: position %d" % (i + 1, pos))
+        for name, start, end in jc.objects:
+            print("object %s: position %d to %d" % (name, start, end))
+
+if __name__ == '__main__':
+    main()
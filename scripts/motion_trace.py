@@ -0,0 +1,212 @@
+#!/usr/bin/env python3
+# Analyze a motion pipeline trace (see klippy/extras/motion_trace.py)
+#
+# Copyright (C) 2026  The Klipper developers
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import optparse, struct, json, bisect
+
+TRACE_MAGIC = b'KLTRACE\n'
+
+# Latency of each step in the pipeline (from the earlier stage to the
+# later stage)
+STEPS = [("lookahead", "move_add", "move_plan"),
+         ("step_gen", "move_plan", "gen_steps"),
+         ("flush", "gen_steps", "steppersync_flush"),
+         ("transmit", "steppersync_flush", "send"),
+         ("ack", "send", "ack"),
+         ("total", "move_add", "ack")]
+
+def read_trace(filename):
+    f = open(filename, 'rb')
+    data = f.read()
+    f.close()
+    if data[:len(TRACE_MAGIC)] != TRACE_MAGIC:
+        raise Exception("%s is not a motion trace" % (filename,))
+    pos = len(TRACE_MAGIC)
+    hlen = struct.unpack_from('<I', data, pos)[0]
+    header = json.loads(data[pos+4:pos+4+hlen].decode())
+    pos += 4 + hlen
+    rs = struct.Struct(str(header['record_format']))
+    records = [rs.unpack_from(data, p)
+               for p in range(pos, len(data) - rs.size + 1, rs.size)]
+    records.sort(key=lambda r: r[0])
+    return header, records
+
+# Return the index of the first item in 'vals' that is >= val
+def find_first(vals, val):
+    return bisect.bisect_left(vals, val)
+
+class TraceAnalyzer:
+    def __init__(self, header, records, mcu_name):
+        stages = header['stages']
+        mcus = {m['name']: m for m in header['mcus']}
+        if mcu_name is None:
+            mcu_name = header['mcus'][0]['name']
+        if mcu_name not in mcus:
+            raise Exception("Unknown mcu '%s'" % (mcu_name,))
+        self.mcu_id = mcus[mcu_name]['id']
+        self.mcu_freq = mcus[mcu_name]['freq']
+        self.records = records
+        self.base_time = records[0][0] if records else 0.
+        # Separate the events of each stage
+        self.moves = {}
+        self.events = {name: [] for name in stages}
+        for r in records:
+            time, v1, v2, stage, rid = r
+            name = stages[stage] if stage < len(stages) else ""
+            if name in ("move_add", "move_plan"):
+                move = self.moves.setdefault(rid, {'id': rid})
+                move[name] = time
+                if name == "move_plan":
+                    move['start_print_time'] = v1
+                    move['end_print_time'] = v2
+            elif name == "gen_steps" or rid == self.mcu_id:
+                self.events[name].append(r)
+        # Note the print time to clock conversion samples
+        clocks = self.events['clock']
+        self.clock_times = [r[0] for r in clocks]
+        self.clock_print_times = [r[1] for r in clocks]
+        self.clock_clocks = [r[2] for r in clocks]
+    # Conversion helpers
+    def print_time_to_clock(self, print_time):
+        pts = self.clock_print_times
+        if not pts:
+            return None
+        i = max(0, find_first(pts, print_time) - 1)
+        return self.clock_clocks[i] + (print_time - pts[i]) * self.mcu_freq
+    def estimated_print_time(self, time):
+        times = self.clock_times
+        if not times:
+            return None
+        i = max(0, find_first(times, time) - 1)
+        return self.clock_print_times[i] + (time - times[i])
+    # Find the time each move passed through each stage
+    def _running_max(self, events, idx):
+        out = []
+        cur = None
+        for r in events:
+            if cur is None or r[idx] > cur:
+                cur = r[idx]
+            out.append(cur)
+        return out
+    def analyze(self):
+        gen = self.events['gen_steps']
+        gen_vals = self._running_max(gen, 1)
+        flushes = self.events['steppersync_flush']
+        flush_vals = self._running_max(flushes, 1)
+        sends = self.events['send']
+        send_vals = self._running_max(sends, 2)
+        acks = self.events['ack']
+        ack_vals = self._running_max(acks, 1)
+        moves = [m for m in self.moves.values()
+                 if 'move_add' in m and 'move_plan' in m]
+        moves.sort(key=lambda m: m['id'])
+        for m in moves:
+            end_print_time = m['end_print_time']
+            i = find_first(gen_vals, end_print_time)
+            if i >= len(gen):
+                continue
+            m['gen_steps'] = gen[i][0]
+            end_clock = self.print_time_to_clock(end_print_time)
+            if end_clock is None:
+                continue
+            i = find_first(flush_vals, end_clock)
+            if i >= len(flushes):
+                continue
+            # Messages may be sent while the flush is running, so note
+            # the time the flush started
+            m['steppersync_flush'] = flushes[i][0] - flushes[i][2]
+            i = find_first(send_vals, end_clock)
+            if i >= len(sends):
+                continue
+            m['send'] = sends[i][0]
+            seq = sends[i][1]
+            i = find_first(ack_vals, seq + 1)
+            if i < len(acks):
+                m['ack'] = acks[i][0]
+            # Time remaining before the move must complete
+            last = m.get('ack', m['send'])
+            m['headroom'] = end_print_time - self.estimated_print_time(last)
+        self.analyzed_moves = moves
+        return moves
+    # Reports
+    def report(self):
+        moves = self.analyzed_moves
+        print("%d moves" % (len(moves),))
+        print("%-10s %7s %9s %9s %9s %9s" % (
+            "step", "count", "p50(ms)", "p90(ms)", "p99(ms)", "max(ms)"))
+        for name, start, end in STEPS:
+            vals = sorted([m[end] - m[start] for m in moves
+                           if start in m and end in m])
+            self._report_line(name, vals)
+        # Time before each move ends when its last message was sent/acked
+        vals = sorted([m['headroom'] for m in moves if 'headroom' in m])
+        print("%-10s %7s %9s %9s %9s %9s" % (
+            "", "count", "min(ms)", "p1(ms)", "p10(ms)", "p50(ms)"))
+        self._report_line("headroom", vals, [.01, .10, .50], True)
+    def _report_line(self, name, vals, pcts=[.50, .90, .99], low=False):
+        if not vals:
+            print("%-10s %7d" % (name, 0))
+            return
+        res = [vals[min(len(vals) - 1, int(len(vals) * p))] for p in pcts]
+        if low:
+            res.insert(0, vals[0])
+        else:
+            res.append(vals[-1])
+        print("%-10s %7d %9.3f %9.3f %9.3f %9.3f" % tuple(
+            [name, len(vals)] + [v * 1000. for v in res]))
+    def write_chrome_trace(self, filename):
+        base = self.base_time
+        def ts(t):
+            return (t - base) * 1000000.
+        out = []
+        stage_order = ["move_add", "move_plan", "gen_steps",
+                       "steppersync_flush", "send", "ack"]
+        for m in self.analyzed_moves:
+            times = [(s, m[s]) for s in stage_order if s in m]
+            for (s, t), (ns, nt) in zip(times, times[1:]):
+                args = {'start_print_time': m['start_print_time'],
+                        'end_print_time': m['end_print_time']}
+                out.append({'name': s, 'cat': "move", 'ph': "b",
+                            'id': m['id'], 'ts': ts(t), 'pid': 1, 'tid': 1,
+                            'args': args})
+                out.append({'name': s, 'cat': "move", 'ph': "e",
+                            'id': m['id'], 'ts': ts(nt), 'pid': 1, 'tid': 1})
+            if 'headroom' in m:
+                out.append({'name': "headroom", 'ph': "C", 'pid': 1,
+                            'ts': ts(times[-1][1]),
+                            'args': {'seconds': m['headroom']}})
+        for tid, name in [(2, "gen_steps"), (3, "steppersync_flush")]:
+            for r in self.events[name]:
+                out.append({'name': name, 'ph': "X", 'pid': 1, 'tid': tid,
+                            'ts': ts(r[0] - r[2]), 'dur': r[2] * 1000000.,
+                            'args': {'value': r[1]}})
+        for tid, name in [(4, "send"), (5, "ack")]:
+            for r in self.events[name]:
+                out.append({'name': name, 'ph': "i", 's': "t", 'pid': 1,
+                            'tid': tid, 'ts': ts(r[0]),
+                            'args': {'seq': r[1]}})
+        f = open(filename, 'w')
+        json.dump({'traceEvents': out, 'displayTimeUnit': "ms"}, f)
+        f.close()
+
+def main():
+    usage = "%prog [options] <trace file>"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-o", "--output", type="string", dest="output",
+                    default=None, help="write a Chrome trace json file")
+    opts.add_option("-m", "--mcu", type="string", dest="mcu", default=None,
+                    help="mcu to report on (default is the first mcu)")
+    options, args = opts.parse_args()
+    if len(args) != 1:
+        opts.error("Incorrect number of arguments")
+    header, records = read_trace(args[0])
+    ta = TraceAnalyzer(header, records, options.mcu)
+    ta.analyze()
+    ta.report()
+    if options.output is not None:
+        ta.write_chrome_trace(options.output)
+
+if __name__ == '__main__':
+    main()
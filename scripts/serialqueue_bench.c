@@ -0,0 +1,152 @@
+// Benchmark for the host serialqueue command scheduling code
+//
+// Copyright (C) 2026  The Klipper developers
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// This tool feeds synthetic messages from a number of command queues
+// through serialqueue.c and reports the cost of building each
+// message block.  The background thread is stopped and the
+// scheduling code is run directly so that only the cost of choosing
+// and packing messages is measured.  Build it with:
+//   gcc -O2 -o serialqueue_bench scripts/serialqueue_bench.c
+//     klippy/chelper/{msgblock,pollreactor,pyhelper,trace}.c -lm -lpthread
+// The -q option sets the number of command queues, -m the number of
+// messages queued on each, and -s the percentage of messages that
+// have a min_clock in the future (and thus start out stalled).  A
+// checksum of the generated message blocks is reported so that a
+// change to the scheduling code can be checked for identical output.
+
+#define _GNU_SOURCE // sendmmsg (used by serialqueue.c)
+#include <fcntl.h> // open
+#include <getopt.h> // getopt
+#include <stdio.h> // printf
+#include <time.h> // clock_gettime
+#include "../klippy/chelper/serialqueue.c"
+
+#define BENCH_FREQ 16000000.
+
+// Simple pseudo random number generator (for reproducible results)
+static uint32_t
+bench_rand(uint32_t *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 8) & 0xffff;
+}
+
+// Queue 'msg_count' messages on each command queue
+static void
+bench_fill(struct serialqueue *sq, struct command_queue **cqs, int cq_count
+           , int msg_count, int stall_pct, uint32_t *seed)
+{
+    int i, j;
+    for (i=0; i<cq_count; i++) {
+        struct list_head msgs;
+        list_init(&msgs);
+        uint64_t req_clock = BENCH_FREQ + bench_rand(seed) * 16;
+        for (j=0; j<msg_count; j++) {
+            uint8_t data[8] = { 20, i, 1 + (bench_rand(seed) & 0x3f), 1, 2 };
+            struct queue_message *qm = message_fill(data, 5);
+            req_clock += 1000 + bench_rand(seed) * 8;
+            qm->req_clock = req_clock;
+            if (bench_rand(seed) % 100 < stall_pct)
+                qm->min_clock = req_clock - BENCH_FREQ * .200;
+            list_add_tail(&qm->node, &msgs);
+        }
+        serialqueue_send_batch(sq, cqs[i], &msgs);
+    }
+}
+
+// Send all queued messages - returns the number of message blocks
+static uint64_t
+bench_drain(struct serialqueue *sq, double *eventtime, uint64_t *checksum)
+{
+    uint8_t buf[MESSAGE_MAX];
+    uint64_t blocks = 0;
+    pthread_mutex_lock(&sq->lock);
+    send_ring_drain(sq);
+    while (sq->ready_bytes || sq->stalled_bytes) {
+        double waketime = check_send_command(sq, 0, *eventtime);
+        if (waketime != PR_NOW) {
+            // Advance the simulated time to the next send time
+            *eventtime = waketime > *eventtime ? waketime : *eventtime + .001;
+            continue;
+        }
+        int len = build_and_send_command(sq, buf, 0, *eventtime), i;
+        for (i=0; i<len; i++)
+            // FNV-1a hash
+            *checksum = (*checksum ^ buf[i]) * 0x100000001b3ULL;
+        blocks++;
+        // Simulate an ack of the sent block
+        message_queue_free(&sq->sent_queue);
+        sq->need_ack_bytes = 0;
+    }
+    pthread_mutex_unlock(&sq->lock);
+    return blocks;
+}
+
+static double
+get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * .000000001;
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-q queues] [-m messages] [-s stall_pct]"
+            " [-r repeat]\n", prog);
+}
+
+int
+main(int argc, char **argv)
+{
+    int cq_count = 16, msg_count = 10000, stall_pct = 25, repeat = 1, opt;
+    while ((opt = getopt(argc, argv, "q:m:s:r:h")) != -1) {
+        switch (opt) {
+        case 'q': cq_count = atoi(optarg); break;
+        case 'm': msg_count = atoi(optarg); break;
+        case 's': stall_pct = atoi(optarg); break;
+        case 'r': repeat = atoi(optarg); break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+
+    // Create a serialqueue and stop its background thread
+    int fd = open("/dev/null", O_WRONLY);
+    struct serialqueue *sq = serialqueue_alloc(fd, SQT_DEBUGFILE, 0);
+    if (!sq)
+        return 1;
+    serialqueue_exit(sq);
+    serialqueue_set_clock_est(sq, BENCH_FREQ, 0., 0, 0);
+    struct command_queue **cqs = malloc(sizeof(*cqs) * cq_count);
+    int i;
+    for (i=0; i<cq_count; i++)
+        cqs[i] = serialqueue_alloc_commandqueue();
+
+    // Report the fastest of 'repeat' runs
+    double duration = 0.;
+    uint64_t blocks = 0, checksum = 0;
+    uint32_t seed = 1;
+    for (i=0; i<repeat || !i; i++) {
+        double eventtime = 0.;
+        checksum = 0xcbf29ce484222325ULL;
+        bench_fill(sq, cqs, cq_count, msg_count, stall_pct, &seed);
+        double start = get_time();
+        blocks = bench_drain(sq, &eventtime, &checksum);
+        double run_time = get_time() - start;
+        if (!i || run_time < duration)
+            duration = run_time;
+    }
+
+    uint64_t msgs = (uint64_t)cq_count * msg_count;
+    printf("queues=%d msgs=%llu blocks=%llu checksum=%016llx\n"
+           "time=%.3f ns_per_block=%.1f ns_per_msg=%.1f\n"
+           , cq_count, (unsigned long long)msgs, (unsigned long long)blocks
+           , (unsigned long long)checksum
+           , duration, duration * 1000000000. / (blocks ? blocks : 1)
+           , duration * 1000000000. / (msgs ? msgs : 1));
+    return 0;
+}
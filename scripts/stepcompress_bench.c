@@ -0,0 +1,322 @@
+// Benchmark and regression test for the host step compression code
+//
+// Copyright (C) 2026  The Klipper developers
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// This tool replays a stream of step times through stepcompress.c
+// and reports the compression rate along with the number, size, and
+// a checksum of the generated commands.  The checksum can be used to
+// verify that a change to the compression code produces identical
+// output.  Build it with:
+//   gcc -O2 -o stepcompress_bench scripts/stepcompress_bench.c
+//     klippy/chelper/{serialqueue,msgblock,pollreactor,pyhelper,trace}.c
+//     -lm -lpthread
+// With no arguments a synthetic set of moves is replayed.  Otherwise
+// the given file is replayed - it is expected to contain the decoded
+// text of a serial data dump (as produced by klippy/parsedump.py).
+// The queue_step, set_next_step_dir, and reset_step_clock commands
+// in that file are converted back into step times.  All step times
+// are loaded into memory before the timed compression starts.
+
+#include <getopt.h> // getopt
+#include <math.h> // sqrt
+#include <stdio.h> // fopen
+#include <stdlib.h> // strtod
+#include <string.h> // strncmp
+#include <time.h> // clock_gettime
+#include "../klippy/chelper/stepcompress.c"
+
+#define MAX_OIDS 256
+
+struct bench_step {
+    uint64_t clock;
+    uint32_t oid, sdir;
+};
+
+struct bench {
+    double mcu_freq;
+    uint32_t max_error;
+    struct bench_step *steps;
+    size_t step_count, step_alloc;
+    struct stepcompress *sc_list[MAX_OIDS];
+    uint64_t msg_count, msg_bytes, checksum;
+};
+
+// Store a step time for later replay
+static void
+bench_add_step(struct bench *b, uint32_t oid, int sdir, uint64_t clock)
+{
+    if (b->step_count >= b->step_alloc) {
+        b->step_alloc = b->step_alloc ? b->step_alloc * 2 : 1024*1024;
+        b->steps = realloc(b->steps, b->step_alloc * sizeof(*b->steps));
+    }
+    struct bench_step *bs = &b->steps[b->step_count++];
+    bs->clock = clock;
+    bs->oid = oid % MAX_OIDS;
+    bs->sdir = sdir;
+}
+
+// Lookup (or allocate) the stepcompress object for an oid
+static struct stepcompress *
+bench_get_sc(struct bench *b, uint32_t oid)
+{
+    oid %= MAX_OIDS;
+    struct stepcompress *sc = b->sc_list[oid];
+    if (!sc) {
+        sc = b->sc_list[oid] = stepcompress_alloc(oid);
+        stepcompress_fill(sc, b->max_error, 1, 2);
+        stepcompress_set_time(sc, 0., b->mcu_freq);
+    }
+    return sc;
+}
+
+// Account for (and free) all messages generated by a stepcompress
+static void
+bench_collect(struct bench *b, struct stepcompress *sc)
+{
+    while (!list_empty(&sc->msg_queue)) {
+        struct queue_message *qm = list_first_entry(
+            &sc->msg_queue, struct queue_message, node);
+        list_del(&qm->node);
+        b->msg_count++;
+        b->msg_bytes += qm->len;
+        int i;
+        for (i=0; i<qm->len; i++)
+            // FNV-1a hash
+            b->checksum = (b->checksum ^ qm->msg[i]) * 0x100000001b3ULL;
+        message_free(qm);
+    }
+}
+
+// Compress all stored step times
+static int
+bench_run(struct bench *b)
+{
+    size_t i;
+    for (i=0; i<MAX_OIDS; i++) {
+        stepcompress_free(b->sc_list[i]);
+        b->sc_list[i] = NULL;
+    }
+    b->msg_count = b->msg_bytes = 0;
+    b->checksum = 0xcbf29ce484222325ULL;
+    for (i=0; i<b->step_count; i++) {
+        struct bench_step *bs = &b->steps[i];
+        struct stepcompress *sc = bench_get_sc(b, bs->oid);
+        int ret = stepcompress_append(sc, bs->sdir, 0.
+                                      , bs->clock / b->mcu_freq);
+        if (ret)
+            return ret;
+        if (sc->queue_next - sc->queue_pos > 4096) {
+            // Periodically flush older steps (as steppersync_flush would)
+            ret = queue_flush(sc, sc->last_step_clock + b->mcu_freq * .100);
+            if (ret)
+                return ret;
+            bench_collect(b, sc);
+        }
+    }
+    // Flush all pending steps
+    for (i=0; i<MAX_OIDS; i++) {
+        struct stepcompress *sc = b->sc_list[i];
+        if (!sc)
+            continue;
+        int ret = stepcompress_flush(sc, UINT64_MAX);
+        if (ret)
+            return ret;
+        bench_collect(b, sc);
+    }
+    return 0;
+}
+
+
+/****************************************************************
+ * Synthetic moves
+ ****************************************************************/
+
+// Simple pseudo random number generator (for reproducible results)
+static double
+bench_rand(uint32_t *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return ((*seed >> 8) & 0xffff) / 65536.;
+}
+
+// Generate the step times of a series of trapezoidal moves
+static void
+bench_synthetic(struct bench *b, int move_count, double step_dist)
+{
+    uint32_t seed = 1;
+    double print_time = .100;
+    int i, sdir = 1;
+    for (i=0; i<move_count; i++) {
+        double move_d = 0.05 + 20. * bench_rand(&seed) * bench_rand(&seed);
+        double cruise_v = 5. + 295. * bench_rand(&seed);
+        double accel = 500. + 9500. * bench_rand(&seed);
+        double start_v = cruise_v * bench_rand(&seed);
+        // Moves start and end at start_v - reduce cruise_v if needed
+        double max_v2 = start_v*start_v + accel * move_d;
+        if (cruise_v * cruise_v > max_v2)
+            cruise_v = sqrt(max_v2);
+        double accel_d = (cruise_v*cruise_v - start_v*start_v) * .5 / accel;
+        double cruise_d = move_d - 2. * accel_d;
+        if (cruise_d < 0.)
+            cruise_d = 0.;
+        double accel_t = 2. * accel_d / (start_v + cruise_v);
+        double cruise_t = cruise_d / cruise_v;
+        if (bench_rand(&seed) < .1)
+            sdir = !sdir;
+        // Calculate each step time using the trapezoid equations
+        int steps = move_d / step_dist, j;
+        for (j=1; j<=steps; j++) {
+            double d = j * step_dist, t;
+            if (d <= accel_d) {
+                t = ((sqrt(start_v*start_v + 2. * accel * d) - start_v)
+                     / accel);
+            } else if (d <= accel_d + cruise_d) {
+                t = accel_t + (d - accel_d) / cruise_v;
+            } else {
+                double v2 = (cruise_v*cruise_v
+                             - 2. * accel * (d - accel_d - cruise_d));
+                t = (accel_t + cruise_t
+                     + (cruise_v - sqrt(v2 > 0. ? v2 : 0.)) / accel);
+            }
+            bench_add_step(b, 0, sdir, (print_time + t) * b->mcu_freq);
+        }
+        print_time += 2. * accel_t + cruise_t;
+    }
+}
+
+
+/****************************************************************
+ * Replay of a serial data dump
+ ****************************************************************/
+
+struct replay_stepper {
+    uint64_t clock;
+    int sdir;
+};
+
+// Extract an integer parameter from a decoded message
+static int
+get_param(const char *line, const char *name, int64_t *val)
+{
+    const char *p = strstr(line, name);
+    if (!p)
+        return -1;
+    *val = strtoll(p + strlen(name), NULL, 0);
+    return 0;
+}
+
+static int
+bench_replay(struct bench *b, const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        fprintf(stderr, "Unable to open %s\n", filename);
+        return -1;
+    }
+    static struct replay_stepper steppers[MAX_OIDS];
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+        int64_t oid, v1, v2, v3;
+        if (get_param(line, " oid=", &oid))
+            continue;
+        struct replay_stepper *rs = &steppers[oid % MAX_OIDS];
+        if (!strncmp(line, "set_next_step_dir ", 18)) {
+            if (!get_param(line, " dir=", &v1))
+                rs->sdir = v1;
+        } else if (!strncmp(line, "reset_step_clock ", 17)) {
+            if (!get_param(line, " clock=", &v1))
+                rs->clock = (rs->clock & ~0xffffffffULL) | (uint32_t)v1;
+        } else if (!strncmp(line, "queue_step ", 11)) {
+            if (get_param(line, " interval=", &v1)
+                || get_param(line, " count=", &v2)
+                || get_param(line, " add=", &v3))
+                continue;
+            uint32_t interval = v1;
+            int i;
+            for (i=0; i<v2; i++) {
+                rs->clock += interval;
+                interval += v3;
+                bench_add_step(b, oid, rs->sdir, rs->clock);
+            }
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+
+/****************************************************************
+ * Startup
+ ****************************************************************/
+
+static double
+get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * .000000001;
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-f mcu_freq] [-e max_error_time]"
+            " [-n moves] [-s step_dist] [-r repeat] [dumpfile]\n", prog);
+}
+
+int
+main(int argc, char **argv)
+{
+    double mcu_freq = 16000000., max_error_time = .000025, step_dist = .0125;
+    int move_count = 10000, repeat = 1, opt;
+    while ((opt = getopt(argc, argv, "f:e:n:s:r:h")) != -1) {
+        switch (opt) {
+        case 'f': mcu_freq = strtod(optarg, NULL); break;
+        case 'e': max_error_time = strtod(optarg, NULL); break;
+        case 'n': move_count = atoi(optarg); break;
+        case 's': step_dist = strtod(optarg, NULL); break;
+        case 'r': repeat = atoi(optarg); break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    static struct bench b;
+    b.mcu_freq = mcu_freq;
+    b.max_error = max_error_time * mcu_freq;
+
+    if (optind < argc) {
+        if (bench_replay(&b, argv[optind]))
+            return 1;
+    } else {
+        bench_synthetic(&b, move_count, step_dist);
+    }
+
+    // Report the fastest of 'repeat' runs
+    double duration = 0.;
+    int i;
+    for (i=0; i<repeat || !i; i++) {
+        double start = get_time();
+        int ret = bench_run(&b);
+        double run_time = get_time() - start;
+        if (ret) {
+            fprintf(stderr, "Error %d during step compression\n", ret);
+            return 1;
+        }
+        if (!i || run_time < duration)
+            duration = run_time;
+    }
+
+    uint32_t msg_alloc, msg_free, msg_malloc;
+    message_pool_stats(&msg_alloc, &msg_free, &msg_malloc);
+    printf("steps=%llu msgs=%llu bytes=%llu checksum=%016llx\n"
+           "time=%.3f steps_per_sec=%.0f steps_per_msg=%.2f msg_mallocs=%u\n"
+           , (unsigned long long)b.step_count
+           , (unsigned long long)b.msg_count
+           , (unsigned long long)b.msg_bytes
+           , (unsigned long long)b.checksum
+           , duration, b.step_count / duration
+           , (double)b.step_count / (b.msg_count ? b.msg_count : 1)
+           , msg_malloc);
+    return 0;
+}
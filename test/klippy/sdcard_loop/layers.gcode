@@ -0,0 +1,14 @@
+; Source of layers.kjob (used by sdcard_job.test).  Regenerate with:
+;   scripts/compile_gcode.py test/klippy/sdcard_loop/layers.gcode
+G90
+;LAYER_CHANGE
+G1 Z0.2 F600
+G1 X10 Y10 F3000
+G1 X20 Y10
+;LAYER_CHANGE
+G1 Z0.4 F600
+G1 X20 Y20 F3000
+G1 X10 Y20
+;LAYER_CHANGE
+G1 Z0.6 F600
+G1 X10 Y10 F3000